@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+arena::arena (size_t block_size_): block_size (block_size_) {
+}
+
+arena::~arena() {
+   release();
+}
+
+void arena::grow (size_t size) {
+   if (not blocks.empty()) blocks.back().second = next;
+   size_t bytes = size > block_size ? size : block_size;
+   char* block = static_cast<char*> (malloc (bytes));
+   assert (block != nullptr);
+   blocks.push_back ({block, block});
+   next = block;
+   limit = block + bytes;
+   reserved += bytes;
+}
+
+void* arena::allocate (size_t size, size_t align) {
+   uintptr_t addr = reinterpret_cast<uintptr_t> (next);
+   size_t pad = (align - addr % align) % align;
+   if (next == nullptr or size + pad > size_t (limit - next)) {
+      grow (size + align);
+      addr = reinterpret_cast<uintptr_t> (next);
+      pad = (align - addr % align) % align;
+   }
+   char* result = next + pad;
+   next = result + size;
+   used += size + pad;
+   ++count;
+   return result;
+}
+
+void arena::deallocate (void* ptr, size_t size) {
+   char* base = static_cast<char*> (ptr);
+   if (base + size != next) return;
+   next = base;
+   used -= size;
+}
+
+void arena::release() {
+   for (auto& block: blocks) free (block.first);
+   blocks.clear();
+   next = limit = nullptr;
+   used = reserved = count = 0;
+}
+
@@ -0,0 +1,92 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+using namespace std;
+
+//
+// DESCRIPTION
+//    Bump allocator.  Storage is carved out of large blocks and is
+//    handed back all at once by release(), so objects allocated
+//    from an arena are never freed one at a time.
+//
+
+struct arena {
+   explicit arena (size_t block_size = 0x10000);
+   ~arena();
+   arena (const arena&) = delete;
+   arena& operator= (const arena&) = delete;
+
+   void* allocate (size_t size, size_t align = alignof (max_align_t));
+   // Returns size bytes aligned to align.  Never returns nullptr.
+
+   void deallocate (void* ptr, size_t size);
+   // Gives the storage back only if it was the most recent
+   // allocation, otherwise it is kept until release().
+
+   void release();
+   // Frees every block at once.
+
+   template <typename func>
+   void each_block (func visit);
+   // Calls visit (begin, end) on the used part of every block,
+   // in allocation order.
+
+   size_t bytes_used() const { return used; }
+   size_t bytes_reserved() const { return reserved; }
+   size_t allocations() const { return count; }
+
+   private:
+      vector<pair<char*,char*>> blocks; // begin and used end
+      size_t block_size;
+      char* next = nullptr;
+      char* limit = nullptr;
+      size_t used = 0;
+      size_t reserved = 0;
+      size_t count = 0;
+      void grow (size_t size);
+};
+
+template <typename func>
+void arena::each_block (func visit) {
+   if (not blocks.empty()) blocks.back().second = next;
+   for (auto& block: blocks) visit (block.first, block.second);
+}
+
+//
+// Allocator adaptor so that standard containers can keep their
+// storage in an arena.
+//
+
+template <typename T>
+struct arena_allocator {
+   using value_type = T;
+   arena* pool;
+   arena_allocator (arena* pool_): pool (pool_) {}
+   template <typename U>
+   arena_allocator (const arena_allocator<U>& that): pool (that.pool) {}
+   T* allocate (size_t n) {
+      return static_cast<T*> (pool->allocate (n * sizeof (T),
+                                              alignof (T)));
+   }
+   void deallocate (T* ptr, size_t n) {
+      pool->deallocate (ptr, n * sizeof (T));
+   }
+};
+
+template <typename T, typename U>
+bool operator== (const arena_allocator<T>& a,
+                 const arena_allocator<U>& b) {
+   return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator!= (const arena_allocator<T>& a,
+                 const arena_allocator<U>& b) {
+   return a.pool != b.pool;
+}
+
+#endif
+
@@ -6,50 +6,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include "astree.h"
 #include "string_set.h"
 #include "lyutils.h"
+#include "flat_tree.h"
+#include "ir.h"
 
 using namespace std;
-using symbol_table = unordered_map<const string*,symbol*>;
+using symbol_table = unordered_map<const interned*,symbol*,interned_hash>;
 using symbol_entry = symbol_table::value_type;
-vector<int> block_stack;
+arena astree::nodes;
+arena astree::lists;
+arena symbol::symbols;
+arena symbol::links (0x1000);
+arena symbol::layouts (0x1000);
 symbol_table global_table;
 symbol_table struct_table;
 astree* current_function;
-int block_nr = 1;
-int string_num = 0;
 int vregcounter = 0;
 symbol_stack stack;
+//Function bodies are checked on worker threads, each with its own
+//scopes and numbering, and each collecting its .sym text and
+//diagnostics so that they can be put in source order afterwards.
+static thread_local vector<int> block_stack;
+static thread_local int block_nr = 1;
+static thread_local int string_num = 0;
+static thread_local symbol_stack* scopes = &stack;
+//Constant expressions are folded as they are checked
+static bool folding = true;
+static thread_local uint64_t folds = 0;
+static thread_local outbuf* sym_out = &sym_file;
+static thread_local string* diagnostics = nullptr;
+//Guards the symbol and link arenas
+static mutex pool_lock;
+//Each function is generated into its own buffer, maybe on a worker
+//thread, and numbers its own vregs
+static thread_local outbuf* oil_out = &oil_file;
+static thread_local int vregs = 0;
 
+astree::astree (int symbol_, const location& lloc_, const char* info):
+   astree (symbol_, lloc_, info, strlen (info)) {
+}
 
-astree::astree (int symbol_, const location& lloc_, const char* info) {
+astree::astree (int symbol_, const location& lloc_, const char* info,
+                size_t len):
+   children (&lists) {
    symbol = symbol_;
+   field_nr = -1;
+   ref = nullptr;
    lloc = lloc_;
-   lexinfo = string_set::intern (info);
-   fprintf(tok_file, "%2zd %-zd.%-5zd %-5d %-15s (%-s)\n",
-                 lloc.filenr,
-                 lloc.linenr,
-                 lloc.offset,
-                 symbol,
-                 parser::get_tname(symbol),
-                 lexinfo->c_str());
+   lexinfo = string_set::intern (info, len);
+   // Same layout as "%2zd %-zd.%-5zd %-5d %-15s (%-s)\n".
+   tok_file.put_int (lloc.filenr, 2);
+   tok_file.put (' ');
+   tok_file.put_int (lloc.linenr);
+   tok_file.put ('.');
+   tok_file.put_int (lloc.offset, -5);
+   tok_file.put (' ');
+   tok_file.put_int (symbol, -5);
+   tok_file.put (' ');
+   tok_file.put_str (parser::get_tname (symbol), -15);
+   tok_file.put (" (");
+   tok_file.put (*lexinfo);
+   tok_file.put (")\n");
    //tokens.push_back(*this);
    // vector defaults to empty -- no children
 }
 
-astree::~astree() {
-   while (not children.empty()) {
-      astree* child = children.back();
-      children.pop_back();
-      delete child;
-   }
-   if (yydebug) {
-      fprintf (stderr, "Deleting astree (");
-      astree::dump (stderr, this);
-      fprintf (stderr, ")\n");
-   }
+void* astree::operator new (size_t size) {
+   return nodes.allocate (size, alignof (astree));
+}
+
+void astree::operator delete (void*) {
+   // Storage belongs to the arena and goes away in release().
+}
+
+void astree::release() {
+   DEBUGF ('m', "%zu nodes in %zu bytes, children %zu bytes,"
+           " %zu bytes reserved\n",
+           nodes.allocations(), nodes.bytes_used(),
+           lists.bytes_used(),
+           nodes.bytes_reserved() + lists.bytes_reserved());
+   // Every node is the same size, so each block is a plain array
+   // of nodes and the tree can be torn down without recursion.
+   nodes.each_block ([] (char* begin, char* end) {
+      for (char* node = begin; node < end; node += sizeof (astree)) {
+         reinterpret_cast<astree*> (node)->~astree();
+      }
+   });
+   nodes.release();
+   lists.release();
+   parser::root = nullptr;
 }
 
 astree* astree::adopt (astree* child1, astree* child2) {
@@ -75,11 +128,13 @@ void astree::dump_node (FILE* outfile) {
 }
 
 void astree::dump_tree (FILE* outfile, int depth) {
-   fprintf (outfile, "%*s", depth * 3, "");
-   dump_node (outfile);
-   fprintf (outfile, "\n");
-   for (astree* child: children) child->dump_tree (outfile, depth + 1);
-   fflush (NULL);
+   walk (this,
+         [outfile, depth] (astree* node, int level) {
+            fprintf (outfile, "%*s", (depth + level) * 3, "");
+            node->dump_node (outfile);
+            fprintf (outfile, "\n");
+         },
+         [] (astree*) { fflush (NULL); });
 }
 
 void astree::dump (FILE* outfile, astree* tree) {
@@ -87,83 +142,118 @@ void astree::dump (FILE* outfile, astree* tree) {
                    else tree->dump_node (outfile);
 }
 
-void astree::print (FILE* outfile, astree* tree, int depth) {
-   for(int i = 0; i < depth; i++){
-   	fprintf (outfile, "| %*s", 2 , "");
+int ast_indent_limit = 0;
+
+void print_ast_node (outbuf& outfile, int symbol, const interned* lexinfo,
+                     const location& lloc, size_t block_nr,
+                     const bitset<ATTR_bitset_size>& attributes,
+                     const location& ref_loc, int depth) {
+   // With a limit, machine-generated nesting does not make the dump
+   // quadratic; deeper lines give their depth.
+   int indent = depth;
+   if (ast_indent_limit > 0 and indent > ast_indent_limit) {
+      indent = ast_indent_limit;
    }
-   fprintf (outfile, "%s \"%s\" (%zd.%zd.%zd) {%lu}",
-            parser::get_tname (tree->symbol), tree->lexinfo->c_str(),
-            tree->lloc.filenr, tree->lloc.linenr, tree->lloc.offset,
-			tree->block_nr);
-   if(tree->attributes[ATTR_int])
-	   fprintf(outfile," int ");
-   else if(tree->attributes[ATTR_void])
-	   fprintf(outfile," void ");
-   else if(tree->attributes[ATTR_null])
-	   fprintf(outfile," null ");
-   else if(tree->attributes[ATTR_string])
-	   fprintf(outfile," string ");
-   else if(tree->attributes[ATTR_struct])
-	   fprintf(outfile," struct ");
+   for(int i = 0; i < indent; i++){
+   	outfile.put ("|   ");
+   }
+   if (indent < depth) {
+      outfile.put ('#');
+      outfile.put_int (depth);
+      outfile.put (' ');
+   }
+   outfile.put (parser::get_tname (symbol));
+   outfile.put (" \"");
+   outfile.put (*lexinfo);
+   outfile.put ("\" (");
+   outfile.put_loc (lloc);
+   outfile.put (") {");
+   outfile.put_int (block_nr);
+   outfile.put ('}');
+   if(attributes[ATTR_int])
+	   outfile.put(" int ");
+   else if(attributes[ATTR_void])
+	   outfile.put(" void ");
+   else if(attributes[ATTR_null])
+	   outfile.put(" null ");
+   else if(attributes[ATTR_string])
+	   outfile.put(" string ");
+   else if(attributes[ATTR_struct])
+	   outfile.put(" struct ");
    
-   if(tree->attributes[ATTR_array])
-	   fprintf(outfile," array ");
+   if(attributes[ATTR_array])
+	   outfile.put(" array ");
    
-   if(tree->attributes[ATTR_function])
-	   fprintf(outfile," function ");
-   else if(tree->attributes[ATTR_variable])
-	   fprintf(outfile," variable ");
-   else if(tree->attributes[ATTR_field])
-	   fprintf(outfile," field ");
-   else if(tree->attributes[ATTR_typeid])
-	   fprintf(outfile," struct ");
+   if(attributes[ATTR_function])
+	   outfile.put(" function ");
+   else if(attributes[ATTR_variable])
+	   outfile.put(" variable ");
+   else if(attributes[ATTR_field])
+	   outfile.put(" field ");
+   else if(attributes[ATTR_typeid])
+	   outfile.put(" struct ");
    
-   if(tree->attributes[ATTR_lval])
-	   fprintf(outfile," lval ");
-   else if(tree->attributes[ATTR_const])
-	   fprintf(outfile," const ");
+   if(attributes[ATTR_lval])
+	   outfile.put(" lval ");
+   else if(attributes[ATTR_const])
+	   outfile.put(" const ");
    
-   if(tree->attributes[ATTR_vreg])
-	   fprintf(outfile," vreg ");
-   else if(tree->attributes[ATTR_vaddr])
-	   fprintf(outfile," vaddr ");
+   if(attributes[ATTR_vreg])
+	   outfile.put(" vreg ");
+   else if(attributes[ATTR_vaddr])
+	   outfile.put(" vaddr ");
    
-   if(tree->symbol == TOK_IDENT){
-	   fprintf(outfile,"(%zd.%zd.%zd)",
-	   tree->ref_loc.filenr,
-	   tree->ref_loc.linenr,
-	   tree->ref_loc.offset);
-   }
-   fprintf(outfile,"\n");
-   for (astree* child: tree->children) {
-      astree::print (outfile, child, depth + 1);
+   if(symbol == TOK_IDENT){
+	   outfile.put('(');
+	   outfile.put_loc(ref_loc);
+	   outfile.put(')');
    }
+   outfile.put('\n');
+}
+
+void astree::print (outbuf& outfile, astree* tree, int depth) {
+   walk (tree,
+         [&outfile, depth] (astree* node, int level) {
+            print_ast_node (outfile, node->symbol, node->lexinfo,
+                            node->lloc, node->block_nr, node->attributes,
+                            node->ref_loc, depth + level);
+         },
+         [] (astree*) {});
 }
 
-void astree::setFile(string name){
-	tok_file = fopen(name.c_str(), "w");
+bool astree::setFile(string name){
+	return tok_file.open(name);
 }
 
 void astree::closeFile(){
-	pclose(tok_file);
+	tok_file.close();
 }
 
 void destroy (astree* tree1, astree* tree2) {
-   if (tree1 != nullptr) delete tree1;
-   if (tree2 != nullptr) delete tree2;
+   // Discarded nodes stay in the arena until astree::release().
+   for (astree* tree: {tree1, tree2}) {
+      if (tree == nullptr or not yydebug) continue;
+      fprintf (stderr, "Deleting astree (");
+      astree::dump (stderr, tree);
+      fprintf (stderr, ")\n");
+   }
 }
 
 void errllocprintf (const location& lloc, const char* format,
                     const char* arg) {
-   static char buffer[0x1000];
+   char buffer[0x1000];
    assert (sizeof buffer > strlen (format) + strlen (arg));
    snprintf (buffer, sizeof buffer, format, arg);
-   errprintf ("%s:%zd.%zd: %s", 
-              lexer::filename (lloc.filenr), lloc.linenr, lloc.offset,
-              buffer);
+   char line[0x1400];
+   snprintf (line, sizeof line, "%s:%zd.%zd: %s",
+             lexer::filename (lloc.filenr)->c_str(), lloc.linenr,
+             lloc.offset, buffer);
+   // Worker threads keep theirs to be printed in source order.
+   if (diagnostics != nullptr) *diagnostics += line;
+                          else errprintf ("%s", line);
 }
 
-string make_oil_field(bitset<ATTR_bitset_size> bits, const string* type){
+string make_oil_field(bitset<ATTR_bitset_size> bits, const interned* type){
 	if(bits[ATTR_array]){
 		if(bits[ATTR_int])
 			return "int*";
@@ -183,390 +273,685 @@ string make_oil_field(bitset<ATTR_bitset_size> bits, const string* type){
 	return "Not supposed to be here?";
 }
 
+//C type of the value node gives, for the vreg that holds it.  A
+//struct semantic analysis could not name, or a null, is a void*.
+string make_oil_type(const astree* node){
+	const bitset<ATTR_bitset_size>& bits = node->attributes;
+	while(node->symbol == '=') node = node->children[0];
+	const interned* name = nullptr;
+	if(node->symbol == '.'){
+		if(node->ref != nullptr){
+			name = node->ref->fields[node->field_nr].type;
+		}
+	}
+	else{
+		const astree* typed = node->symbol == TOK_CALL
+			|| node->symbol == TOK_INDEX ? node->children[0] : node;
+		if(typed->ref != nullptr) name = typed->ref->name;
+	}
+	if(bits[ATTR_int] || bits[ATTR_string]
+			|| (bits[ATTR_typeid] && name != nullptr)){
+		return make_oil_field(bits, name);
+	}
+	return "void*";
+}
+
 void print_string_cons(astree* node){
-	for(astree* child: node->children){
-		print_string_cons(child);
+	astree::walk(node, [](astree*, int){}, [](astree* n){
+		if(n->symbol == TOK_STRINGCON){
+			oil_file.printf("%s\n",n->string_con.c_str());
+		}
+	});
+}
+
+//String constants are leaves, so a pre-order scan of the flat
+//layout meets them in the same order as the recursion above
+void print_string_cons(const flat_tree& flat){
+	for(uint32_t i = 0; i < flat.size(); i++){
+		if(flat.symbol[i] == TOK_STRINGCON){
+			oil_file.printf("%s\n",flat.string_con[i]->c_str());
+		}
 	}
-	if(node->symbol == TOK_STRINGCON){
-		fprintf(oil_file,"%s\n",node->string_con.c_str());
+}
+
+//The vregs of the function being generated.  Every vreg is read
+//once, by the node above the one that set it, so it is dead as soon
+//as that node is generated and goes back on its C type's spare list;
+//an a vreg of one struct cannot hold a pointer to another.  Values
+//that are never live at once share a local, and each local is
+//declared once at the top of the function.
+struct vreg_pool{
+	string allocate(vreg_kind k, const string& type);
+	void release(const string& name);
+	void declare(outbuf& out) const;
+	void clear();
+	private:
+		unordered_map<string,vector<string>> spare;
+		//C type and name, in the order the names were made
+		vector<pair<string,string>> declared[VREG_KINDS];
+		unordered_map<string,const string*> live;
+};
+
+string vreg_pool::allocate(vreg_kind k, const string& type){
+	string name;
+	vector<string>& names = spare[type];
+	if(!names.empty()){
+		name = move(names.back());
+		names.pop_back();
 	}
+	else{
+		name = vreg_prefix[k] + to_string(++vregs);
+		declared[k].emplace_back(type, name);
+	}
+	//Keys of spare stay put, so live can point at them
+	live.emplace(name, &spare.find(type)->first);
+	return name;
+}
+
+//Names that are not live vregs, constants and variables, are ignored
+void vreg_pool::release(const string& name){
+	auto found = live.find(name);
+	if(found == live.end()) return;
+	spare[*found->second].push_back(name);
+	live.erase(found);
 }
 
+void vreg_pool::declare(outbuf& out) const{
+	for(int k = 0; k < VREG_KINDS; k++){
+		for(const auto& local: declared[k]){
+			out.printf("        %s %s;\n", local.first.c_str(),
+				local.second.c_str());
+		}
+	}
+}
+
+//Keeps the spare lists' memory for the next function
+void vreg_pool::clear(){
+	for(auto& names: spare) names.second.clear();
+	for(int k = 0; k < VREG_KINDS; k++) declared[k].clear();
+	live.clear();
+	vregs = 0;
+}
+
+static thread_local vreg_pool temps;
+
 string vreg (astree* node) { // e . g . i23, a53, p69
-  string typechar;
-  if (node->attributes[ATTR_int]) { typechar = "i"; }
-  else if(node->attributes[ATTR_string]){ typechar = "p"; }
-  node->string_con = typechar + to_string(++vregcounter);
-  return typechar + to_string(++vregcounter);
+  vreg_kind k = vreg_kind_of(node->attributes);
+  return temps.allocate(k, k == VREG_ADDRESS ? make_oil_type(node)
+                                             : vreg_type[k]);
 }
 
-string func_codegen(astree* node){
+//One pending node of the code generator.  step counts the children
+//handed out so far; the first two results are kept for the output.
+struct codegen_frame{
+	astree* node;
+	size_t step;
+	string leftv;
+	string rightv;
+};
+
+static void print_binary(const string& target,
+		const codegen_frame& f, const char* op){
+	oil_out->printf("        %s = %s %s %s;\n",
+						target.c_str(),
+						f.leftv.c_str(),
+						op,
+						f.rightv.c_str());
+}
+
+//Carries on generating f->node.  Returns the next child to generate
+//before coming back here, or nullptr once the node is done and its
+//value is in result.
+static astree* codegen_step(codegen_frame& f, string& result){
+	astree* node = f.node;
 	switch(node->symbol){
 		case TOK_BLOCK :{
-			for (astree* child : node->children) func_codegen(child);
+			if(f.step < node->children.size())
+				return node->children[f.step++];
 			break;
 		}
 		case TOK_RETURN:{
-			string target = func_codegen(node->children[0]);
-			fprintf(oil_file,"return %s;\n", target.c_str());
+			if(f.step == 0) return node->children[f.step++];
+			oil_out->printf("return %s;\n", f.leftv.c_str());
 			break;
 		}
-		case '+':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s + %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case '-':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s - %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case '*':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s * %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case '/':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s / %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case TOK_LE:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s <= %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case TOK_LT:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s < %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case TOK_GE:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s >= %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case TOK_GT:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s > %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}
-		case TOK_NE:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s != %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}/*
-		case '!':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s != %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
-		}*/
+		case '+':
+		case '-':
+		case '*':
+		case '/':
+		case TOK_LE:
+		case TOK_LT:
+		case TOK_GE:
+		case TOK_GT:
+		case TOK_NE:
 		case TOK_EQ:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
+			if(f.step < 2) return node->children[f.step++];
 			string target = vreg(node);
-			fprintf(oil_file, "        %s %s = %s == %s;\n",
-								make_oil_field(node->attributes,node->lexinfo).c_str(),
-								target.c_str(),
-								leftv.c_str(),
-								rightv.c_str());
-			return target;
+			switch(node->symbol){
+				case '+': print_binary(target, f, "+"); break;
+				case '-': print_binary(target, f, "-"); break;
+				case '*': print_binary(target, f, "*"); break;
+				case '/': print_binary(target, f, "/"); break;
+				case TOK_LE: print_binary(target, f, "<="); break;
+				case TOK_LT: print_binary(target, f, "<"); break;
+				case TOK_GE: print_binary(target, f, ">="); break;
+				case TOK_GT: print_binary(target, f, ">"); break;
+				case TOK_NE: print_binary(target, f, "!="); break;
+				case TOK_EQ: print_binary(target, f, "=="); break;
+			}
+			result = target;
+			return nullptr;
 		}
 		case TOK_WHILE:{
-			fprintf(oil_file,"while_%lu_%lu_%lu:;\n",node->lloc.filenr,node->lloc.linenr,node->lloc.offset);
-			string target = func_codegen(node->children[0]);
-			fprintf(oil_file,"if(!%s) goto break_%lu_%lu_%lu;\n",
-				target.c_str(),
+			if(f.step == 0){
+				oil_out->printf("while_%lu_%lu_%lu:;\n",node->lloc.filenr,node->lloc.linenr,node->lloc.offset);
+				return node->children[f.step++];
+			}
+			if(f.step == 1){
+				oil_out->printf("if(!%s) goto break_%lu_%lu_%lu;\n",
+					f.leftv.c_str(),
+					node->lloc.filenr,
+					node->lloc.linenr,
+					node->lloc.offset);
+				return node->children[f.step++];
+			}
+			oil_out->printf("goto while_%lu_%lu_%lu;\n",
 				node->lloc.filenr,
 				node->lloc.linenr,
 				node->lloc.offset);
-			func_codegen(node->children[1]);
-			fprintf(oil_file,"goto while_%lu_%lu_%lu;\n",
-				node->lloc.filenr,
-				node->lloc.linenr,
-				node->lloc.offset);
-			fprintf(oil_file,"break_%lu_%lu_%lu:;\n",
+			oil_out->printf("break_%lu_%lu_%lu:;\n",
 				node->lloc.filenr,
 				node->lloc.linenr,
 				node->lloc.offset);
 			break;
 		}
 		case TOK_IF:{
-			string target = func_codegen(node->children[0]);
-			fprintf(oil_file,"if(!%s) goto fi_%lu_%lu_%lu;\n",
-				target.c_str(),
-				node->lloc.filenr,
-				node->lloc.linenr,
-				node->lloc.offset);
-			func_codegen(node->children[1]);	
-			fprintf(oil_file,"fi_%lu_%lu_%lu:;\n",
+			if(f.step == 0) return node->children[f.step++];
+			if(f.step == 1){
+				oil_out->printf("if(!%s) goto fi_%lu_%lu_%lu;\n",
+					f.leftv.c_str(),
+					node->lloc.filenr,
+					node->lloc.linenr,
+					node->lloc.offset);
+				return node->children[f.step++];
+			}
+			oil_out->printf("fi_%lu_%lu_%lu:;\n",
 				node->lloc.filenr,
 				node->lloc.linenr,
 				node->lloc.offset);
 			break;
 		}
 		case TOK_IFELSE:{
-			string target = func_codegen(node->children[0]);
-			fprintf(oil_file,"if(!%s) goto else_%lu_%lu_%lu;\n",
-				target.c_str(),
-				node->lloc.filenr,
-				node->lloc.linenr,
-				node->lloc.offset);
-			func_codegen(node->children[1]);
-			fprintf(oil_file,"goto fi_%lu_%lu_%lu;\n",
-				node->lloc.filenr,
-				node->lloc.linenr,
-				node->lloc.offset);
-			fprintf(oil_file,"else_%lu_%lu_%lu;\n",
-				node->lloc.filenr,
-				node->lloc.linenr,
-				node->lloc.offset);
-			func_codegen(node->children[2]);
-			fprintf(oil_file,"fi_%lu_%lu_%lu;\n",
+			if(f.step == 0) return node->children[f.step++];
+			if(f.step == 1){
+				oil_out->printf("if(!%s) goto else_%lu_%lu_%lu;\n",
+					f.leftv.c_str(),
+					node->lloc.filenr,
+					node->lloc.linenr,
+					node->lloc.offset);
+				return node->children[f.step++];
+			}
+			if(f.step == 2){
+				oil_out->printf("goto fi_%lu_%lu_%lu;\n",
+					node->lloc.filenr,
+					node->lloc.linenr,
+					node->lloc.offset);
+				oil_out->printf("else_%lu_%lu_%lu;\n",
+					node->lloc.filenr,
+					node->lloc.linenr,
+					node->lloc.offset);
+				return node->children[f.step++];
+			}
+			oil_out->printf("fi_%lu_%lu_%lu;\n",
 				node->lloc.filenr,
 				node->lloc.linenr,
 				node->lloc.offset);
 			break;
 		}
 		case TOK_INTCON : {// no vreg , return constant itself
-			return *(node->lexinfo);
+			result = node->lexinfo->str();
+			return nullptr;
 		}
 		case TOK_NULL:{
-			return string("0");
+			result = string("0");
+			return nullptr;
 		}
 		case TOK_CALL:{
-			fprintf(oil_file,"        __%s(",node->children[0]->lexinfo->c_str());
-			string target = "";
-			for(size_t i = 1; i < node->children.size(); i++){
-				string target = func_codegen(node->children[i]);
-			}
-			fprintf(oil_file,"%s);\n",target.c_str());
+			if(f.step == 0){
+				oil_out->printf("        __%s(",node->children[0]->lexinfo->c_str());
+				f.step = 1;
+			}
+			//The argument values are not used yet
+			if(f.step < node->children.size())
+				return node->children[f.step++];
+			oil_out->printf(");\n");
 			break;
 		}
-		case '=':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
+		case '=':
+		case TOK_ARRAY:
+		case TOK_INDEX:
+		case TOK_VARDECL:{
+			if(f.step < 2) return node->children[f.step++];
 			string target = vreg(node);
-			fprintf(oil_file, "        %s = %s;\n",
+			oil_out->printf("        %s = %s;\n",
 								target.c_str(),
-								leftv.c_str());
-			return target;
+								f.leftv.c_str());
+			result = target;
+			return nullptr;
 		}
 		case '.':{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
+			if(f.step < 2) return node->children[f.step++];
 			string target = vreg(node);
-			fprintf(oil_file, "        %s = %s;\n",
+			if(node->ref != nullptr){
+				const field_desc& field = node->ref->fields[node->field_nr];
+				oil_out->printf("        %s = %s->f_%s_%s;\n",
 								target.c_str(),
-								leftv.c_str());
-			return target;
-		}
-		case TOK_ARRAY:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s = %s;\n",
-								target.c_str(),
-								leftv.c_str());
-			return target;
-		}
-		case TOK_INDEX:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s = %s;\n",
+								f.leftv.c_str(),
+								node->ref->name->c_str(),
+								field.name->c_str());
+			}
+			else{
+				oil_out->printf("        %s = %s;\n",
 								target.c_str(),
-								leftv.c_str());
-			return target;
+								f.leftv.c_str());
+			}
+			result = target;
+			return nullptr;
 		}
 		case TOK_IDENT:{
-			return "__"+*(node->lexinfo);
-		}
-		case TOK_VARDECL:{
-			string leftv = func_codegen(node->children[0]);
-			string rightv = func_codegen(node->children[1]);
-			string target = vreg(node);
-			fprintf(oil_file, "        %s = %s;\n",
-								target.c_str(),
-								leftv.c_str());
-			return target;
+			result = "__"+node->lexinfo->str();
+			return nullptr;
 		}
 		case TOK_FIELD:{
-			return "__"+*(node->lexinfo);
+			result = "__"+node->lexinfo->str();
+			return nullptr;
 		}
 	}
-	return *(node->lexinfo);
+	result = node->lexinfo->str();
+	return nullptr;
+}
+
+//Generates node and everything under it, keeping the pending nodes
+//on an explicit stack so that nesting depth is bounded by memory
+string func_codegen(astree* node){
+	vector<codegen_frame> frames;
+	string result;
+	frames.push_back({node, 0, "", ""});
+	while(true){
+		astree* child = codegen_step(frames.back(), result);
+		if(child != nullptr){
+			frames.push_back({child, 0, "", ""});
+			continue;
+		}
+		//The node has read its operands for the last time
+		temps.release(frames.back().leftv);
+		temps.release(frames.back().rightv);
+		frames.pop_back();
+		if(frames.empty()) return result;
+		codegen_frame& parent = frames.back();
+		//Statements and call arguments are not read by anything
+		if(parent.node->symbol == TOK_BLOCK
+				|| parent.node->symbol == TOK_CALL) temps.release(result);
+		else if(parent.step == 1) parent.leftv = move(result);
+		else if(parent.step == 2) parent.rightv = move(result);
+		else temps.release(result);
+	}
+}
+
+//One function's code, generated apart and merged in source order
+struct codegen_job{
+	astree* func;
+	string oil;
+	string ir;
+	int vregs;
+};
+
+//What a thread generates functions with, kept from one to the next
+//for the memory
+struct codegen_state{
+	outbuf capture;
+	outbuf body;
+	ir_function ir;
+	codegen_state(){
+		capture.open_memory();
+		body.open_memory();
+	}
+};
+
+//One line for -@d of what optimize() removed from the function
+static string removed_report(const ir_function& ir, const char* name){
+	char line[256];
+	snprintf(line, sizeof line, "%s: removed %u constant branches,"
+			" %u unreachable blocks (%u instructions),"
+			" %u repeated expressions, %u hoisted out of loops,"
+			" %u unused temporaries, %u blocks\n", name,
+			ir.removed.branches, ir.removed.unreachable,
+			ir.removed.unreachable_code, ir.removed.common,
+			ir.removed.hoisted, ir.removed.temps,
+			ir.removed.blocks);
+	return line;
+}
+
+//Puts the code for statements in out, through the IR unless --no-ir
+//was given.  Returns the number of vregs declared for it.
+template <typename nodes>
+static int codegen_statements(outbuf& out, codegen_state& state,
+		astree* params, const nodes& statements, const char* name,
+		string& dump){
+	if(!ir_function::enabled){
+		codegen_body(out, state.body, [&](){
+			for(astree* node: statements) func_codegen(node);
+		});
+		return vregs;
+	}
+	ir_function& ir = state.ir;
+	ir.clear();
+	if(params != nullptr) ir.lower_params(params);
+	for(astree* node: statements) ir.lower(node);
+	ir.optimize();
+	if(is_debugflag('i')){
+		state.body.clear();
+		ir.dump(state.body, name);
+		dump.assign(state.body.data(), state.body.size());
+	}
+	if(is_debugflag('d')) dump += removed_report(ir, name);
+	return ir.emit(out);
 }
 
-void make_oil_file(){
+//Generates a function's statements into body, then writes them to
+//out behind the declarations of the vregs they use
+template <typename statements>
+static void codegen_body(outbuf& out, outbuf& body, statements generate){
+	body.clear();
+	temps.clear();
+	oil_out = &body;
+	generate();
+	oil_out = &out;
+	temps.declare(out);
+	out.put(body.data(), body.size());
+}
+
+static void function_codegen(codegen_job& job, codegen_state& state){
+	outbuf& capture = state.capture;
+	capture.clear();
+	oil_out = &capture;
+	astree* child = job.func;
+	if(child->attributes[ATTR_int])
+		oil_out->printf("int ");
+	if(child->attributes[ATTR_string])
+		oil_out->printf("char* ");
+	oil_out->printf("__%s (",child->children[0]->children[0]->lexinfo->c_str());
+	
+	if(child->children[1]->symbol == TOK_PARAMLIST){
+		for(astree* node: child->children[1]->children){
+			switch(node->symbol){
+				case TOK_INT:{
+					oil_out->printf("\n        int _%lu_%s",node->block_nr,node->children[0]->lexinfo->c_str());
+				}
+				case TOK_STRING:{
+					oil_out->printf("\n        char* _%lu_%s",node->block_nr,node->children[0]->lexinfo->c_str());
+				}
+				case TOK_IDENT:{
+					oil_out->printf("\n        %s _%lu_%s",node->lexinfo->c_str(),node->block_nr,node->children[0]->lexinfo->c_str());
+				}
+			}
+		}
+	}
+	oil_out->printf(")\n{\n");
+	astree* params = child->children[1]->symbol == TOK_PARAMLIST
+		? child->children[1] : nullptr;
+	astree* body[] = {child->children.back()};
+	job.vregs = codegen_statements(capture, state, params, body,
+		child->children[0]->children[0]->lexinfo->c_str(), job.ir);
+	capture.printf("}\n");
+	job.oil.assign(capture.data(), capture.size());
+	oil_out = &oil_file;
+}
+
+void make_oil_file(const flat_tree* flat, int threads){
 	//Prints structs
 	string type = "";
 	for(auto s: struct_table){
-		fprintf(oil_file,"struct s_%s {\n",s.first->c_str());
-		for(auto f: *s.second->fields){
-			type = make_oil_field(f.second->attributes, s.first);
-			fprintf(oil_file,"        %s f_%s_%s\n",type.c_str(),s.first->c_str(),f.first->c_str());
+		oil_file.printf("struct s_%s {\n",s.first->c_str());
+		for(const field_desc& f: *s.second->fields){
+			type = make_oil_field(f.attributes, s.first);
+			oil_file.printf("        %s f_%s_%s\n",type.c_str(),s.first->c_str(),f.name->c_str());
 		}
-		fprintf(oil_file,"};\n");
+		oil_file.printf("};\n");
 	}
 	
 	//Print string constants
-	print_string_cons(parser::root);
+	if(flat != nullptr) print_string_cons(*flat);
+	else print_string_cons(parser::root);
 	//Global variables
 	if(stack.symbol_stack[0] != nullptr){
 		for(auto s: *stack.symbol_stack[0]){
 			type = make_oil_field(s.second->attributes, s.first);
-			fprintf(oil_file,"%s __%s",type.c_str(),s.first->c_str());
+			oil_file.printf("%s __%s",type.c_str(),s.first->c_str());
 		}
 	}
-	fprintf(oil_file,"\n");
+	oil_file.printf("\n");
 	//Go through all the functions
+	vector<codegen_job> jobs;
 	for(astree* child: parser::root->children){
-		if(child->symbol == TOK_FUNC){
-			if(child->attributes[ATTR_int])
-				fprintf(oil_file,"int ");
-			if(child->attributes[ATTR_string])
-				fprintf(oil_file,"char* ");
-			fprintf(oil_file,"__%s (",child->children[0]->children[0]->lexinfo->c_str());
-			
-			if(child->children[1]->symbol == TOK_PARAMLIST){
-				for(astree* node: child->children[1]->children){
-					switch(node->symbol){
-						case TOK_INT:{
-							fprintf(oil_file,"\n        int _%lu_%s",node->block_nr,node->children[0]->lexinfo->c_str());
-						}
-						case TOK_STRING:{
-							fprintf(oil_file,"\n        char* _%lu_%s",node->block_nr,node->children[0]->lexinfo->c_str());
-						}
-						case TOK_IDENT:{
-							fprintf(oil_file,"\n        %s _%lu_%s",node->lexinfo->c_str(),node->block_nr,node->children[0]->lexinfo->c_str());
-						}
-					}
-				}
-			}
-			fprintf(oil_file,")\n{\n");
-			func_codegen(child->children.back());
-			fprintf(oil_file,"}\n");
-		}
+		if(child->symbol == TOK_FUNC) jobs.push_back({child, "", "", 0});
 	}
-	fprintf(oil_file,"void __ocmain (void)\n{\n");
-	for(astree* child: parser::root->children){
-		if(child->symbol != TOK_FUNC ||child->symbol != TOK_STRUCT || child->symbol != TOK_PROTO){
-			func_codegen(child);
-		}
+	atomic<size_t> next_job(0);
+	auto work = [&](){
+		codegen_state state;
+		for(size_t i; (i = next_job++) < jobs.size();){
+			function_codegen(jobs[i], state);
+		}
+	};
+	vector<thread> workers;
+	for(int i = 1; i < threads && size_t(i) < jobs.size(); i++){
+		workers.emplace_back(work);
+	}
+	work();
+	for(thread& worker: workers) worker.join();
+	for(codegen_job& job: jobs){
+		oil_file.put(job.oil);
+		vregcounter += job.vregs;
+		if(!job.ir.empty()) fputs(job.ir.c_str(), stderr);
 	}
-	fprintf(oil_file,"}\n");
+	//Everything at the top level goes in __ocmain, the declarations
+	//too, which generate no code
+	oil_file.printf("void __ocmain (void)\n{\n");
+	codegen_state state;
+	string dump;
+	vregcounter += codegen_statements(oil_file, state, nullptr,
+		parser::root->children, "__ocmain", dump);
+	oil_file.printf("}\n");
+	fputs(dump.c_str(), stderr);
 }
 
-symbol_table* symbol_stack::pop(){
-	symbol_table* sym;
-	sym = symbol_stack.back();
+//Bindings that have gone out of scope, kept for reuse
+static thread_local binding* spare_bindings = nullptr;
+//Global bindings made so far, which is what a body may see
+static unsigned next_order = 0;
+
+void* symbol::operator new (size_t size){
+	lock_guard<mutex> guard(pool_lock);
+	stats::add(stats::SYMBOLS);
+	return symbols.allocate(size, alignof(symbol));
+}
+
+static binding* new_binding(symbol* sym, binding* shadowed){
+	binding* b = spare_bindings;
+	if(b != nullptr) spare_bindings = b->shadowed;
+	else{
+		lock_guard<mutex> guard(pool_lock);
+		b = static_cast<binding*>(
+			symbol::links.allocate(sizeof(binding), alignof(binding)));
+	}
+	b->sym = sym;
+	b->shadowed = shadowed;
+	b->order = scopes->local ? 0 : next_order++;
+	return b;
+}
+
+//Takes b off the list it heads or sits in
+static void unbind(binding*& list, binding* b){
+	binding** link = &list;
+	while(*link != b) link = &(*link)->shadowed;
+	*link = b->shadowed;
+	b->shadowed = spare_bindings;
+	spare_bindings = b;
+}
+
+void symbol_stack::pop(){
+	//Nothing refers to a closed scope's table any more
+	delete symbol_stack.back();
 	symbol_stack.pop_back();
-	return sym;
+	//Undo the bindings made in this scope
+	while(trail.size() > marks.back()){
+		auto& undo = trail.back();
+		unbind(head(undo.first), undo.second);
+		trail.pop_back();
+	}
+	marks.pop_back();
 }
 
 void symbol_stack::push(symbol_table* table){
 	symbol_stack.push_back(table);
+	marks.push_back(trail.size());
 }
 
-void symbol_stack::push(symbol* symbol,const string* key){
+void symbol_stack::push(symbol* symbol,const interned* key){
 	if(symbol_stack.back() == nullptr){
 		symbol_stack.back() = new symbol_table;
 	}
 	symbol_table* table = symbol_stack.back();
 	(*table)[key] = symbol;
+	binding*& list = head(key);
+	list = new_binding(symbol, list);
+	trail.push_back({key, list});
 }
 
-symbol* type_to_symbol(astree* node, bool array){
-	symbol* a = new symbol();
-	
-	if(array){ 
-		a->attributes[ATTR_array] = true;
-		switch(node->children[0]->symbol){
-		case TOK_INT:{
-			a->attributes[ATTR_int] = true;
-			break;
-		}
-		case TOK_VOID:{
-			a->attributes[ATTR_void] = true;
-			break;
-		}
-		case TOK_NULL:{
-			a->attributes[ATTR_null] = true;
-			break;
-		}
-		case TOK_STRING:{
-			a->attributes[ATTR_string] = true;
-			break;
-		}
-		case TOK_IDENT:{
-			a = lookup(node->lexinfo);
-			break;
+binding*& symbol_stack::head(const interned* key){
+	if(local) return heads[key];
+	return string_set::entry_of(key).value;
+}
+
+//Skips global bindings made after this stack was set up
+binding* symbol_stack::visible_of(binding* list){
+	while(list != nullptr && list->order >= visible) list = list->shadowed;
+	return list;
+}
+
+binding* symbol_stack::value(const interned* name){
+	if(local){
+		auto found = heads.find(name);
+		if(found != heads.end() && found->second != nullptr){
+			return found->second;
 		}
+	}
+	return visible_of(string_set::entry_of(name).value);
+}
+
+binding* symbol_stack::type(const interned* name){
+	return visible_of(string_set::entry_of(name).type);
+}
+
+//Functions and prototypes stay visible for the rest of the file
+void bind_global(symbol* sym, const interned* key){
+	global_table[key] = sym;
+	binding*& list = string_set::entry_of(key).value;
+	list = new_binding(sym, list);
+}
+
+void bind_type(symbol* sym, const interned* key){
+	struct_table[key] = sym;
+	binding*& list = string_set::entry_of(key).type;
+	list = new_binding(sym, list);
+}
+
+void param_list::push_back(symbol* param){
+	if(count < inline_size){
+		first[count++] = param;
+		return;
+	}
+	size_t spilled = count - inline_size;
+	if(spilled == capacity){
+		capacity = capacity == 0 ? 4 : 2 * capacity;
+		symbol** grown = static_cast<symbol**>(symbol::links.allocate(
+			capacity * sizeof(symbol*), alignof(symbol*)));
+		copy(rest, rest + spilled, grown);
+		rest = grown;
+	}
+	rest[spilled] = param;
+	++count;
+}
+
+static stats::symbol_kind kind_of(const symbol& sym){
+	if(sym.attributes[ATTR_function]) return stats::FUNCTION_SYMBOLS;
+	if(sym.attributes[ATTR_param]) return stats::PARAM_SYMBOLS;
+	if(sym.attributes[ATTR_field]) return stats::FIELD_SYMBOLS;
+	if(sym.attributes[ATTR_variable]) return stats::VARIABLE_SYMBOLS;
+	if(sym.attributes[ATTR_typeid]) return stats::STRUCT_SYMBOLS;
+	return stats::OTHER_SYMBOLS;
+}
+
+//Frees every symbol, scope and field table and binding at once.
+//Interned names keep no bindings into freed memory.
+void symbol::release(){
+	DEBUGF('m', "%zu symbols in %zu bytes, links %zu bytes,"
+		" layouts %zu bytes, %zu bytes reserved\n",
+		symbols.allocations(), symbols.bytes_used(),
+		links.bytes_used(), layouts.bytes_used(),
+		symbols.bytes_reserved() + links.bytes_reserved()
+		+ layouts.bytes_reserved());
+	//Every symbol is the same size, so each block is a plain array
+	size_t fields = 0;
+	symbols.each_block([&fields](char* begin, char* end){
+		for(char* p = begin; p < end; p += sizeof(symbol)){
+			symbol* sym = reinterpret_cast<symbol*>(p);
+			stats::add_symbol_memory(kind_of(*sym), sizeof(symbol));
+			if(sym->fields != nullptr) fields += sym->fields->size;
+		}
+	});
+	stats::add_symbol_memory(stats::FIELD_SYMBOLS, layouts.bytes_used(),
+		fields);
+	stats::add_symbol_memory(stats::LINKS, links.bytes_used(),
+		links.allocations());
+	for(auto& undo: stack.trail){
+		string_set::entry_of(undo.first).value = nullptr;
+	}
+	for(auto& global: global_table){
+		string_set::entry_of(global.first).value = nullptr;
+	}
+	for(auto& type: struct_table){
+		string_set::entry_of(type.first).type = nullptr;
+	}
+	for(symbol_table* table: stack.symbol_stack) delete table;
+	stack.symbol_stack.clear();
+	stack.trail.clear();
+	stack.marks.clear();
+	global_table.clear();
+	struct_table.clear();
+	spare_bindings = nullptr;
+	symbols.release();
+	links.release();
+	layouts.release();
+}
+
+symbol* type_to_symbol(astree* node, bool array){
+	astree* type = array ? node->children[0] : node;
+	symbol* a = nullptr;
+	//A struct type gets a copy of the declaration's symbol, so that
+	//what is declared with it does not change the struct itself
+	if(type->symbol == TOK_IDENT){
+		symbol* s = lookup_type(node->lexinfo);
+		if(s != nullptr){
+			a = new symbol();
+			a->attributes = s->attributes;
+			a->fields = s->fields;
 		}
 	}
 	else{
-		switch(node->symbol){
+		a = new symbol();
+		if(array) a->attributes[ATTR_array] = true;
+		switch(type->symbol){
 			case TOK_INT:{
 				a->attributes[ATTR_int] = true;
 				break;
@@ -583,10 +968,6 @@ symbol* type_to_symbol(astree* node, bool array){
 				a->attributes[ATTR_string] = true;
 				break;
 			}
-			case TOK_IDENT:{
-				a = lookup(node->lexinfo);
-				break;
-			}
 		}
 	}
 	if(a != nullptr){	
@@ -596,31 +977,82 @@ symbol* type_to_symbol(astree* node, bool array){
 
 }
 
-symbol* lookup(const string* name){
-	if(struct_table.find(name) != struct_table.end())
-		return struct_table[name];
-	if(global_table.find(name) != global_table.end()){
-		return global_table[name];
-	}
-	
-	for(int i = stack.symbol_stack.size()-1; i>=0; i--){
-		if(stack.symbol_stack[i] == nullptr) continue;
-		if(stack.symbol_stack[i]->find(name) != stack.symbol_stack[i]->end()){
-			return (*stack.symbol_stack[i])[name];
+//Innermost variable or function called name.  Identifiers in
+//declarations can also name a struct type, so fall back to those.
+symbol* lookup(const interned* name){
+	binding* b = scopes->value(name);
+	if(b == nullptr) b = scopes->type(name);
+	return b == nullptr ? nullptr : b->sym;
+}
+
+symbol* lookup_type(const interned* name){
+	binding* b = scopes->type(name);
+	return b == nullptr ? nullptr : b->sym;
+}
+
+const field_desc* struct_layout::find(const interned* field) const{
+	if(index == nullptr){
+		for(const field_desc& f: *this){
+			if(f.name == field) return &f;
 		}
+		return nullptr;
 	}
-	
+	for(size_t slot = string_set::hash_of(field);; ++slot){
+		uint32_t entry = index[slot & index_mask];
+		if(entry == 0) return nullptr;
+		if(fields[entry - 1].name == field) return &fields[entry - 1];
+	}
+}
 
-	return nullptr;
+//Copies the fields into the layout arena and indexes them
+static const struct_layout* make_layout(const interned* name,
+		const vector<field_desc>& fields){
+	struct_layout* layout = static_cast<struct_layout*>(
+		symbol::layouts.allocate(sizeof(struct_layout),
+			alignof(struct_layout)));
+	field_desc* copy = static_cast<field_desc*>(
+		symbol::layouts.allocate(fields.size() * sizeof(field_desc),
+			alignof(field_desc)));
+	uninitialized_copy(fields.begin(), fields.end(), copy);
+	layout->name = name;
+	layout->fields = copy;
+	layout->size = fields.size();
+	layout->bytes = 0;
+	layout->index = nullptr;
+	layout->index_mask = 0;
+	for(field_desc* f = copy; f != copy + fields.size(); ++f){
+		uint32_t width = f->attributes[ATTR_int] && !f->attributes[ATTR_array]
+			? 4 : 8;
+		f->offset = (layout->bytes + width - 1) / width * width;
+		layout->bytes = f->offset + width;
+	}
+	layout->bytes = (layout->bytes + 7) / 8 * 8;
+	if(layout->size > struct_layout::linear_limit){
+		size_t slots = 1;
+		while(slots < 2 * layout->size) slots *= 2;
+		uint32_t* index = static_cast<uint32_t*>(
+			symbol::layouts.allocate(slots * sizeof(uint32_t),
+				alignof(uint32_t)));
+		fill(index, index + slots, 0);
+		for(const field_desc& f: *layout){
+			size_t slot = string_set::hash_of(f.name);
+			while(index[slot & (slots - 1)] != 0) ++slot;
+			index[slot & (slots - 1)] = f.ordinal + 1;
+		}
+		layout->index = index;
+		layout->index_mask = slots - 1;
+	}
+	return layout;
 }
 
-symbol_table* create_field_table(astree* node){
-	symbol_table* table = new symbol_table();
+const struct_layout* create_field_table(astree* node){
+	vector<field_desc> fields;
 	astree* child = nullptr;
 	for(size_t i = 1; i< node->children.size();i++){
 		child = node->children[i];
-		symbol* s = new symbol();
-		const string* key = new string();
+		field_desc desc = {};
+		field_desc* s = &desc;
+		const interned* key = nullptr;
 		if(child->children[0]->symbol == TOK_NEWARRAY){
 			switch(child->symbol){
 				case TOK_INT:{
@@ -636,14 +1068,14 @@ symbol_table* create_field_table(astree* node){
 					break;
 				}
 				case TOK_IDENT:{
-					if(lookup(node->children[0]->lexinfo) != nullptr){
+					if(lookup_type(node->children[0]->lexinfo) != nullptr){
 						s->attributes[ATTR_typeid] = true;
+						s->type = child->lexinfo;
 						//s->ref = lookup(node->children[0]->lexinfo);
 					}
 					break;
 				}
 			}
-			s->lloc = child->lloc;
 			s->attributes[ATTR_array] = true;
 			key = child->children[0]->children[0]->lexinfo;
 		}
@@ -662,52 +1094,59 @@ symbol_table* create_field_table(astree* node){
 					break;
 				}
 				case TOK_IDENT:{
-					if(lookup(node->children[0]->lexinfo) != nullptr){
+					if(lookup_type(node->children[0]->lexinfo) != nullptr){
 						s->attributes[ATTR_typeid] = true;
+						s->type = child->lexinfo;
 						//s->ref = lookup(node->children[0]->lexinfo);
 					}
 					break;
 				}
 			}
-			s->lloc = child->lloc;
 			key = child->children[0]->lexinfo;
 		}
 		s->attributes[ATTR_field] = true;
-		(*table)[key] = s;
+		s->name = key;
+		//A repeated name replaces the earlier field's type
+		auto same = find_if(fields.begin(), fields.end(),
+			[key](const field_desc& f){ return f.name == key; });
+		if(same != fields.end()){
+			same->attributes = s->attributes;
+			same->type = s->type;
+		}
+		else{
+			s->ordinal = fields.size();
+			fields.push_back(*s);
+		}
 		
-		fprintf (sym_file, "   %s (%zd.%zd.%zd) field {%s}",
-            key->c_str(), s->lloc.filenr,s->lloc.linenr,s->lloc.offset,
+		sym_out->printf("   %s (%zd.%zd.%zd) field {%s}",
+            key->c_str(), child->lloc.filenr,child->lloc.linenr,child->lloc.offset,
 			node->children[0]->lexinfo->c_str());
 		switch(child->symbol){
 			case TOK_INT:{
-				fprintf(sym_file," int ");
+				sym_out->printf(" int ");
 				break;
 			}
 			case TOK_STRING:{
-				fprintf(sym_file," string ");
+				sym_out->printf(" string ");
 				break;
 			}
 			case TOK_CHAR:{
-				fprintf(sym_file," char ");
+				sym_out->printf(" char ");
 				break;
 			}
 			case TOK_IDENT:{
-				fprintf(sym_file," struct \"%s\" ", child->lexinfo->c_str());
+				sym_out->printf(" struct \"%s\" ", child->lexinfo->c_str());
 				break;
 			}
 		}
-		fprintf(sym_file,"\n");	
+		sym_out->printf("\n");	
 	}
-	return table;
+	return make_layout(node->children[0]->lexinfo, fields);
 }
 
 void fill_paramlist(astree* node, symbol* a){
-	const string* key = new string();
-	symbol* b = new symbol();
-	symbol_table* table = stack.symbol_stack.back();
-	if(table == nullptr){
-		table = new symbol_table;
-	}
+	const interned* key = nullptr;
+	symbol* b = nullptr;
 	for(size_t i = 0; i < node->children.size();i++){
 		if(node->children[i]->symbol == TOK_ARRAY){
 			b = type_to_symbol(node->children[i],true);
@@ -719,15 +1158,14 @@ void fill_paramlist(astree* node, symbol* a){
 		}
 		b->attributes[ATTR_param] = true;
 		b->attributes[ATTR_lval]  = true;
-		a->parameters->push_back(b);
-		(*table)[key] = b;
-		stack.push(b,key);
+		a->parameters.push_back(b);
+		scopes->push(b,key);
 		
 		for(size_t j = 0; j < block_stack.size()-1; j++){
-			fprintf(sym_file,"   ");
+			sym_out->printf("   ");
 		}
 		
-		fprintf (sym_file,"%s (%zd.%zd.%zd) {%d} ",
+		sym_out->printf("%s (%zd.%zd.%zd) {%d} ",
             key->c_str(),
 			node->children[i]->lloc.filenr,
 			node->children[i]->lloc.linenr,
@@ -735,23 +1173,23 @@ void fill_paramlist(astree* node, symbol* a){
 			block_stack.back());
 		switch(node->children[i]->symbol){
 			case TOK_INT:{
-				fprintf(sym_file," int ");
+				sym_out->printf(" int ");
 				break;
 			}
 			case TOK_STRING:{
-				fprintf(sym_file," string ");
+				sym_out->printf(" string ");
 				break;
 			}
 			case TOK_CHAR:{
-				fprintf(sym_file," char ");
+				sym_out->printf(" char ");
 				break;
 			}
 			case TOK_IDENT:{
-				fprintf(sym_file," struct \"%s\" ", node->children[i]->lexinfo->c_str());
+				sym_out->printf(" struct \"%s\" ", node->children[i]->lexinfo->c_str());
 				break;
 			}
 		}
-		fprintf(sym_file,"variable lval param\n");	
+		sym_out->printf("variable lval param\n");	
 	}
 }
 
@@ -771,52 +1209,26 @@ bool compatible(bitset<ATTR_bitset_size> left, bitset<ATTR_bitset_size> right){
 		(left[ATTR_typeid] && right[ATTR_typeid]));
 }
 
-symbol* lookup(astree* node){
-	symbol* a = lookup(node->lexinfo);
-	if(a == nullptr){
-		a = new symbol();
-		switch(node->symbol){
-			case TOK_INTCON:{
-				a->attributes[ATTR_int] = true;
-				break;
-			}
-			case TOK_STRINGCON:{
-				a->attributes[ATTR_string] = true;
-				break;
-			}
-			case TOK_CHARCON:{
-				a->attributes[ATTR_int] = true;
-				break;
-			}
-			default:{
-				a = nullptr;
-				break;
-			}
-		}
-	}
-	return a;
-}
-
 astree* call_lookup(astree* node){
 	astree* a = node;
-	if(node->symbol != TOK_IDENT)
-		a = call_lookup(node->children[0]);
+	while(a->symbol != TOK_IDENT)
+		a = a->children[0];
 	return a;
 }
 
-void semantic_analysis(astree* node){
-	//Pre-order actions for functions
+//Pre-order actions for functions
+static void enter_node(astree* node){
 	switch(node->symbol){
 		case TOK_ROOT:{
-			stack.symbol_stack.push_back(nullptr);
+			scopes->push(nullptr);
 			block_stack.push_back(0);
 			break;
 		}
 		case TOK_FUNC:{
 			symbol* a = type_to_symbol(node->children[0]);
-			a->parameters = new vector<symbol*>;
+			a->parameters.clear();
 			a->attributes[ATTR_function] = true;
-			const string* key = node->children[0]->children[0]->lexinfo;
+			const interned* key = node->children[0]->children[0]->lexinfo;
 			string type = "Not supposed to be here";
 			switch(node->children[0]->symbol){
 				case TOK_INT:{
@@ -837,13 +1249,13 @@ void semantic_analysis(astree* node){
 				}
 			}
 			
-			fprintf (sym_file, "%s (%zd.%zd.%zd) {%d} %s function \n",
+			sym_out->printf("%s (%zd.%zd.%zd) {%d} %s function \n",
             key->c_str(), node->lloc.filenr,node->lloc.linenr,node->lloc.offset,
 			block_stack.back(),type.c_str());
 			
 			block_stack.push_back(block_nr++);
-			stack.symbol_stack.push_back(nullptr);
-			stack.next_block++;
+			scopes->push(nullptr);
+			scopes->next_block++;
 			
 			if(node->children[1]->symbol == TOK_PARAMLIST){
 				fill_paramlist(node->children[1],a);
@@ -857,15 +1269,15 @@ void semantic_analysis(astree* node){
 			else if(a->attributes[ATTR_typeid]){
 				node->attributes[ATTR_typeid] = true;
 			}
-			global_table[key] = a;
+			bind_global(a, key);
 			break;
 		}
 		case TOK_PROTO:{
 			block_stack.push_back(block_nr++);
-			stack.symbol_stack.push_back(nullptr);
-			stack.next_block++;
-			symbol* a = new symbol();
-			const string*  key = new string();
+			scopes->push(nullptr);
+			scopes->next_block++;
+			symbol* a = nullptr;
+			const interned* key = nullptr;
 			if(node->children[0]->symbol == TOK_ARRAY){
 				a = type_to_symbol(node->children[0]->children[0]);
 				key = node->children[0]->children[1]->lexinfo;
@@ -874,7 +1286,7 @@ void semantic_analysis(astree* node){
 				a = type_to_symbol(node->children[0]);
 				key = node->children[0]->children[0]->lexinfo;
 			}
-			a->parameters = new vector<symbol*>;
+			a->parameters.clear();
 			a->attributes[ATTR_function] = true;
 			
 			string type = "Not supposed to be here";
@@ -918,13 +1330,13 @@ void semantic_analysis(astree* node){
 				}
 			}
 			
-			fprintf (sym_file, "%s (%zd.%zd.%zd) {0} %s prototype \n",
+			sym_out->printf("%s (%zd.%zd.%zd) {0} %s prototype \n",
             key->c_str(), node->lloc.filenr,node->lloc.linenr,node->lloc.offset,
 			type.c_str());
 			
 			if(node->children.size() > 1){
-				symbol* b = new symbol();
-				//const string* key = new string();
+				symbol* b = nullptr;
+				//const interned* key = new string();
 				for(size_t i = 1; i < node->children.size(); i++){
 					if(node->children[i]->symbol == TOK_ARRAY){
 						b = type_to_symbol(node->children[i]->children[0], true);
@@ -936,9 +1348,9 @@ void semantic_analysis(astree* node){
 					}
 					b->attributes[ATTR_param] = true;
 					b->attributes[ATTR_lval] = true;
-					a->parameters->push_back(b);
+					a->parameters.push_back(b);
 					
-					fprintf (sym_file,"   %s (%zd.%zd.%zd) {%d} ",
+					sym_out->printf("   %s (%zd.%zd.%zd) {%d} ",
 						node->children[i]->lexinfo->c_str(),
 						node->children[i]->lloc.filenr,
 						node->children[i]->lloc.linenr,
@@ -946,58 +1358,58 @@ void semantic_analysis(astree* node){
 						block_stack.back());
 					switch(node->children[i]->symbol){
 						case TOK_INT:{
-							fprintf(sym_file," int ");
+							sym_out->printf(" int ");
 							break;
 						}
 						case TOK_STRING:{
-							fprintf(sym_file," string ");
+							sym_out->printf(" string ");
 							break;
 						}
 						case TOK_CHAR:{
-							fprintf(sym_file," char ");
+							sym_out->printf(" char ");
 							break;
 						}
 						case TOK_IDENT:{
-							fprintf(sym_file," struct \"%s\" ", node->children[i]->lexinfo->c_str());
+							sym_out->printf(" struct \"%s\" ", node->children[i]->lexinfo->c_str());
 							break;
 						}
 						case TOK_ARRAY:{
 							switch(node->children[0]->children[0]->symbol){
 								case TOK_INT:{
-									fprintf(sym_file, " array int ");
+									sym_out->printf(" array int ");
 									break;
 								}
 								case TOK_STRING:{
-									fprintf(sym_file," array string ");
+									sym_out->printf(" array string ");
 									break;
 								}
 								case TOK_VOID:{
-									fprintf(sym_file," array void ");
+									sym_out->printf(" array void ");
 									break;
 								}
 								case TOK_IDENT:{
-									fprintf(sym_file," array struct \"");
-									fprintf(sym_file,node->children[0]->children[0]->lexinfo->c_str());
-									fprintf(sym_file,"\"");
+									sym_out->printf(" array struct \"");
+									sym_out->put(*node->children[0]->children[0]->lexinfo);
+									sym_out->printf("\"");
 									break;
 								}
 							}
 							break;
 						}
 					}
-					fprintf(sym_file,"variable lval param\n");	
+					sym_out->printf("variable lval param\n");	
 				}
 			}
-			global_table[key] = a;		
+			bind_global(a, key);		
 			break;
 		}
 		case TOK_STRUCT:{
 			symbol* a = type_to_symbol(node->children[0],false);
-			const string* key = node->children[0]->lexinfo;
+			const interned* key = node->children[0]->lexinfo;
 			a->attributes[ATTR_typeid] = true;
-			struct_table[key] = a;
+			bind_type(a, key);
 			
-			fprintf (sym_file, "\n%s (%zd.%zd.%zd) {0} struct \"%s\" \n",
+			sym_out->printf("\n%s (%zd.%zd.%zd) {0} struct \"%s\" \n",
             key->c_str(), node->lloc.filenr,node->lloc.linenr,node->lloc.offset,
 			key->c_str());
 			
@@ -1006,20 +1418,20 @@ void semantic_analysis(astree* node){
 		}
 		case TOK_WHILE:{
 			block_stack.push_back(block_nr++);
-			stack.symbol_stack.push_back(nullptr);
-			stack.next_block++;
+			scopes->push(nullptr);
+			scopes->next_block++;
 			break;
 		}
 		case TOK_IF:{
 			block_stack.push_back(block_nr++);
-			stack.symbol_stack.push_back(nullptr);
-			stack.next_block++;
+			scopes->push(nullptr);
+			scopes->next_block++;
 			break;
 		}
 		case TOK_IFELSE:{
 			block_stack.push_back(block_nr++);
-			stack.symbol_stack.push_back(nullptr);
-			stack.next_block++;
+			scopes->push(nullptr);
+			scopes->next_block++;
 			break;
 		}
 		case TOK_BLOCK:{
@@ -1028,11 +1440,10 @@ void semantic_analysis(astree* node){
 		}
 	}
 	node->block_nr = block_stack.back();
-	//Go through all the child nodes first
-	for(astree* child: node->children){
-		semantic_analysis(child);
-	}
-	//Post-order actions
+}
+
+//Post-order actions, once all the child nodes are done
+static void leave_node(astree* node){
 	switch(node->symbol){
 		case TOK_IDENT:{
 			symbol* a = lookup(node->lexinfo);
@@ -1052,8 +1463,8 @@ void semantic_analysis(astree* node){
 			break;
 		}
 		case TOK_VARDECL:{
-			symbol* a = new symbol();
-			const string* key = new string();
+			symbol* a = nullptr;
+			const interned* key = nullptr;
 			if(node->children[0]->symbol == TOK_ARRAY){
 				a = type_to_symbol(node->children[0],true);
 				key = node->children[0]->children[1]->lexinfo;
@@ -1071,7 +1482,7 @@ void semantic_analysis(astree* node){
 			a->attributes[ATTR_variable] = true;
 			a->attributes[ATTR_lval] = true;
 			a->block_nr = block_stack.back();
-			stack.push(a,key);
+			scopes->push(a,key);
 			
 			string type = "Not supposed to be here";
 			switch(node->children[0]->symbol){
@@ -1114,9 +1525,9 @@ void semantic_analysis(astree* node){
 				}
 			}
 			for(size_t i = 0; i < block_stack.size()-1; i++){
-				fprintf(sym_file,"   ");
+				sym_out->printf("   ");
 			}
-			fprintf (sym_file, "%s (%zd.%zd.%zd) {%d} %s variable lval\n",
+			sym_out->printf("%s (%zd.%zd.%zd) {%d} %s variable lval\n",
             key->c_str(), 
 			node->lloc.filenr,
 			node->lloc.linenr,
@@ -1135,29 +1546,29 @@ node->children.back()->children.back()->attributes)){
 					"");
 				}
 			}
-			stack.pop();
+			scopes->pop();
 			block_stack.pop_back();
-			fprintf(sym_file,"\n");
+			sym_out->printf("\n");
 			break;
 		}
 		case TOK_PROTO:{
-			stack.pop();
+			scopes->pop();
 			block_stack.pop_back();
-			fprintf(sym_file,"\n");
+			sym_out->printf("\n");
 			break;
 		}
 		case TOK_WHILE:{
-			stack.pop();
+			scopes->pop();
 			block_stack.pop_back();
 			break;
 		}
 		case TOK_IF:{
-			stack.pop();
+			scopes->pop();
 			block_stack.pop_back();
 			break;
 		}
 		case TOK_IFELSE:{
-			stack.pop();
+			scopes->pop();
 			block_stack.pop_back();
 			break;
 		}
@@ -1308,16 +1719,19 @@ node->children.back()->children.back()->attributes)){
 			}
 			astree* s = call_lookup(node->children[0]);
 			symbol* a = lookup(s->lexinfo);
-			if(a->fields->find(node->children[1]->lexinfo) == a->fields->end()){
+			//Resolved once here; codegen reads the ordinal off the node
+			const field_desc* b = a->fields == nullptr ? nullptr
+				: a->fields->find(node->children[1]->lexinfo);
+			if(b == nullptr){
 				errllocprintf(node->lloc,
 					"Struct %s does not have field.\n",
 					node->children[0]->lexinfo->c_str());
 			}else{
-				symbol* b = (*a->fields)[node->children[1]->lexinfo];
 				node->attributes = b->attributes;
 				node->attributes[ATTR_vaddr] = true;
 				node->attributes[ATTR_lval] = true;
 				node->ref = a->fields;
+				node->field_nr = b->ordinal;
 			}
 			break;
 		}
@@ -1469,15 +1883,15 @@ node->children.back()->children.back()->attributes)){
 					node->attributes[ATTR_typeid] = true;
 				}
 			}
-			if(node->children.size() != 1 + a->parameters->size()){
+			if(node->children.size() != 1 + a->parameters.size()){
 				errllocprintf(node->lloc,
 					"Wrong number of arguments!%s\n",
 					"");
 			}
-			else if(a->parameters->size() > 0 && node->children.size() > 1){
+			else if(a->parameters.size() > 0 && node->children.size() > 1){
 				//Cycle through the parameters comparing to the function parameters for type
 				for(size_t i = 1; i < node->children.size(); i++){
-					if(!compatible(node->children[i]->attributes,(*a->parameters)[i-1]->attributes)){
+					if(!compatible(node->children[i]->attributes,a->parameters[i-1]->attributes)){
 						errllocprintf(node->lloc,
 						"Incompatible types.\n",
 						"");
@@ -1567,3 +1981,249 @@ node->children.back()->children.back()->attributes)){
 		}
 	}	
 }
+
+//Value of an int or char constant, if it is one and fits in an int.
+//Literals with a leading 0 are left alone, since C reads them as octal.
+static bool constant_value(const astree* node, int32_t& value){
+	const interned& text = *node->lexinfo;
+	if(node->symbol == TOK_INTCON){
+		if(text.size() > 1 && text[0] == '0') return false;
+		char* end;
+		long long number = strtoll(text.c_str(), &end, 10);
+		if(*end != '\0' || number < INT32_MIN || number > INT32_MAX){
+			return false;
+		}
+		value = number;
+		return true;
+	}
+	if(node->symbol != TOK_CHARCON) return false;
+	char c = text[1];
+	if(c == '\\'){
+		switch(text[2]){
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case '0': c = '\0'; break;
+			default:  c = text[2];
+		}
+	}
+	value = static_cast<signed char>(c);
+	return true;
+}
+
+//Evaluates node on constant operands as the generated C would, with
+//ints that wrap.  Division by zero and INT_MIN / -1 are not folded,
+//and neither is a result of INT_MIN, which has no int literal.
+static bool fold(const astree* node, int32_t a, int32_t b,
+		int32_t& result){
+	uint32_t ua = a, ub = b;
+	switch(node->symbol){
+		case '+': result = int32_t(ua + ub); break;
+		case '-': result = int32_t(ua - ub); break;
+		case '*': result = int32_t(ua * ub); break;
+		case '/':
+		case '%':
+			if(b == 0 || (a == INT32_MIN && b == -1)) return false;
+			result = node->symbol == '/' ? a / b : a % b;
+			break;
+		case TOK_LT: result = a < b; break;
+		case TOK_LE: result = a <= b; break;
+		case TOK_GT: result = a > b; break;
+		case TOK_GE: result = a >= b; break;
+		case TOK_EQ: result = a == b; break;
+		case TOK_NE: result = a != b; break;
+		case '!': result = !a; break;
+		case TOK_NEG: result = int32_t(0u - ua); break;
+		case TOK_POS: result = a; break;
+		default: return false;
+	}
+	return result != INT32_MIN;
+}
+
+//Replaces node with the int constant it comes to, if its operands
+//are constants by now
+static void fold_node(astree* node){
+	size_t operands;
+	switch(node->symbol){
+		case '+': case '-': case '*': case '/': case '%':
+		case TOK_LT: case TOK_LE: case TOK_GT: case TOK_GE:
+		case TOK_EQ: case TOK_NE:
+			operands = 2;
+			break;
+		case '!': case TOK_NEG: case TOK_POS:
+			operands = 1;
+			break;
+		default:
+			return;
+	}
+	int32_t value[2] = {0, 0};
+	if(node->children.size() != operands) return;
+	for(size_t i = 0; i < operands; i++){
+		if(!constant_value(node->children[i], value[i])) return;
+	}
+	int32_t result;
+	if(!fold(node, value[0], value[1], result)) return;
+	//Becomes the literal; the old children stay in the arena
+	node->symbol = TOK_INTCON;
+	node->lexinfo = string_set::intern(to_string(result).c_str());
+	node->children.clear();
+	node->attributes.reset();
+	node->attributes[ATTR_int] = true;
+	node->attributes[ATTR_const] = true;
+	folds++;
+}
+
+static void analyze(astree* node){
+	astree::walk(node,
+		[](astree* n, int){ enter_node(n); },
+		[](astree* n){
+			leave_node(n);
+			//Children are folded once their parent is checked, so that
+			//the diagnostics are the same either way
+			if(folding) for(astree* child: n->children) fold_node(child);
+		});
+	if(folding) fold_node(node);
+}
+
+//A function body, checked apart from the rest of the file once all
+//the declarations are in.  Its numbering and the globals it can see
+//are fixed by where it is in the file.
+struct body_job{
+	astree* func;
+	int func_block;
+	int block_nr;
+	int string_num;
+	unsigned visible;
+	vector<pair<const interned*,symbol*>> params;
+	string sym;
+	string diagnostics;
+	uint64_t folds;
+};
+
+//Output of the declaration pass between two function bodies
+struct decl_segment{
+	string sym;
+	string diagnostics;
+};
+
+static void check_body(body_job& job, symbol_stack& local,
+		outbuf& capture){
+	symbol_stack* saved = scopes;
+	scopes = &local;
+	local.local = true;
+	local.visible = job.visible;
+	sym_out = &capture;
+	diagnostics = &job.diagnostics;
+	block_stack.assign({0, job.func_block});
+	block_nr = job.block_nr;
+	string_num = job.string_num;
+	//The file's scope, whose names are all global, then the function's
+	local.push(nullptr);
+	local.push(nullptr);
+	for(auto& param: job.params) local.push(param.second, param.first);
+	uint64_t folded = folds;
+	for(astree* child: job.func->children) analyze(child);
+	job.folds = folds - folded;
+	leave_node(job.func);
+	local.pop();
+	job.sym.assign(capture.data(), capture.size());
+	capture.clear();
+	scopes = saved;
+	sym_out = &sym_file;
+	diagnostics = nullptr;
+}
+
+//Numbers the body of func will use up
+static void count_body(astree* func, int& blocks, int& strings){
+	astree::walk(func, [&](astree* n, int){
+		switch(n->symbol){
+			case TOK_WHILE:
+			case TOK_IF:
+			case TOK_IFELSE:
+				++blocks;
+				break;
+			case TOK_STRINGCON:
+				++strings;
+				break;
+		}
+	}, [](astree*){});
+}
+
+//Structs, prototypes, globals and function signatures are declared
+//in one pass in file order, then the function bodies, which only
+//read what was declared, are checked by worker threads.  The .sym
+//text and diagnostics come out in file order either way.
+void semantic_analysis(astree* node, int threads, bool fold){
+	folding = fold;
+	folds = 0;
+	vector<body_job> jobs;
+	vector<decl_segment> segments(1);
+	outbuf capture;
+	capture.open_memory();
+	sym_out = &capture;
+	diagnostics = &segments.back().diagnostics;
+	auto cut = [&](){
+		segments.back().sym.assign(capture.data(), capture.size());
+		capture.clear();
+		segments.emplace_back();
+		diagnostics = &segments.back().diagnostics;
+	};
+	enter_node(node);
+	for(astree* child: node->children){
+		if(child->symbol != TOK_FUNC){
+			analyze(child);
+			continue;
+		}
+		enter_node(child);
+		body_job job;
+		job.func = child;
+		job.func_block = block_stack.back();
+		job.block_nr = block_nr;
+		job.string_num = string_num;
+		job.visible = next_order;
+		for(size_t i = stack.marks.back(); i < stack.trail.size(); i++){
+			job.params.push_back({stack.trail[i].first,
+				stack.trail[i].second->sym});
+		}
+		count_body(child, block_nr, string_num);
+		stack.pop();
+		block_stack.pop_back();
+		jobs.push_back(move(job));
+		cut();
+	}
+	leave_node(node);
+	segments.back().sym.assign(capture.data(), capture.size());
+	sym_out = &sym_file;
+	diagnostics = nullptr;
+	uint64_t total_folds = folds;
+
+	atomic<size_t> next_job(0);
+	auto work = [&](){
+		symbol_stack local;
+		outbuf body_capture;
+		body_capture.open_memory();
+		for(size_t i; (i = next_job++) < jobs.size();){
+			check_body(jobs[i], local, body_capture);
+		}
+	};
+	vector<thread> workers;
+	for(int i = 1; i < threads && size_t(i) < jobs.size(); i++){
+		workers.emplace_back(work);
+	}
+	work();
+	for(thread& worker: workers) worker.join();
+	for(body_job& job: jobs) total_folds += job.folds;
+	stats::add(stats::FOLDS, total_folds);
+
+	for(size_t i = 0; i < segments.size(); i++){
+		sym_file.put(segments[i].sym);
+		if(!segments[i].diagnostics.empty()){
+			errprintf("%s", segments[i].diagnostics.c_str());
+		}
+		if(i < jobs.size()){
+			sym_file.put(jobs[i].sym);
+			if(!jobs[i].diagnostics.empty()){
+				errprintf("%s", jobs[i].diagnostics.c_str());
+			}
+		}
+	}
+}
@@ -8,8 +8,15 @@
 #include <bitset>
 #include <unordered_map>
 using namespace std;
+#include "arena.h"
+#include "outbuf.h"
+#include "string_set.h"
+#include "stats.h"
 struct symbol;
-using symbol_table = unordered_map<const string*,symbol*>;
+struct astree;
+struct flat_tree;
+struct struct_layout;
+using symbol_table = unordered_map<const interned*,symbol*,interned_hash>;
 #include "auxlib.h"
 
 enum { ATTR_void, ATTR_int, ATTR_null, ATTR_string,
@@ -18,8 +25,9 @@ enum { ATTR_void, ATTR_int, ATTR_null, ATTR_string,
        ATTR_vreg, ATTR_vaddr, ATTR_bitset_size
 };
 
-extern FILE* sym_file;
-extern FILE* oil_file;
+extern outbuf sym_file;
+extern outbuf oil_file;
+extern int vregcounter;
 
 struct location {
    size_t filenr;
@@ -29,64 +37,184 @@ struct location {
 
 
 
+using astree_list = vector<astree*,arena_allocator<astree*>>;
+
 struct astree {
 
    // Fields.
    int symbol;               // token code
+   int field_nr;             // ordinal of the field a '.' selects
    location lloc;            // source location
-   const string* lexinfo;    // pointer to lexical information
-   vector<astree*> children; // children of this n-way node
-   static FILE* tok_file;
+   const interned* lexinfo;    // pointer to lexical information
+   astree_list children;     // children of this n-way node
+   static outbuf tok_file;
    bitset<ATTR_bitset_size> attributes;
    size_t block_nr;
-   symbol_table* ref;
+   const struct_layout* ref; // struct an identifier or '.' uses
    location ref_loc;
    string string_con;
+   // Nodes and their children lists live in these arenas and are
+   // only freed by release(), which tears down the whole tree.
+   static arena nodes;
+   static arena lists;
    // Functions.
-   static void setFile(string name);
+   static bool setFile(string name);
    static void closeFile();
+   static void release();
+   static void* operator new (size_t size);
+   static void operator delete (void* ptr);
    astree (int symbol, const location&, const char* lexinfo);
-   ~astree();
+   astree (int symbol, const location&, const char* lexinfo,
+           size_t len);
    astree* adopt (astree* child1, astree* child2 = nullptr);
    astree* adopt_sym (astree* child, int symbol);
    void dump_node (FILE*);
    void dump_tree (FILE*, int depth = 0);
    static void dump (FILE* outfile, astree* tree);
-   static void print (FILE* outfile, astree* tree, int depth = 0);
+   static void print (outbuf& outfile, astree* tree, int depth = 0);
+   template <typename enter_fn, typename leave_fn>
+   static void walk (astree* root, enter_fn enter, leave_fn leave);
+   // Calls enter (node, depth) on the way down and leave (node) on
+   // the way back up, in the order a recursive walk would, but with
+   // an explicit stack so that any depth fits in the C++ stack.
+};
+
+template <typename enter_fn, typename leave_fn>
+void astree::walk (astree* root, enter_fn enter, leave_fn leave) {
+   vector<pair<astree*,size_t>> work {{root, 0}};
+   enter (root, 0);
+   while (not work.empty()) {
+      astree* node = work.back().first;
+      size_t& next = work.back().second;
+      if (next < node->children.size()) {
+         astree* child = node->children[next++];
+         enter (child, work.size());
+         work.push_back ({child, 0});
+      }else {
+         work.pop_back();
+         leave (node);
+      }
+   }
+}
+
+//Parameter types of a function.  Most functions take only a few,
+//so those are kept in the symbol itself and the rest spill into
+//symbol::links.
+struct param_list{
+   size_t size() const { return count; }
+   symbol* operator[](size_t i) const {
+      return i < inline_size ? first[i] : rest[i - inline_size];
+   }
+   void push_back(symbol* param);
+   void clear() { count = 0; }
+   private:
+      static const size_t inline_size = 3;
+      uint32_t count = 0;
+      uint32_t capacity = 0;     // of rest
+      symbol* first[inline_size];
+      symbol** rest = nullptr;
+};
+
+//One field of a struct.  ordinal is the declaration order and
+//offset assumes 4-byte ints and 8-byte pointers.
+struct field_desc{
+   const interned* name;       // interned
+   const interned* type;       // struct of a struct field, interned
+   bitset<ATTR_bitset_size> attributes;
+   uint32_t ordinal;
+   uint32_t offset;
+};
+
+//Fields of a struct in one contiguous array, built once when the
+//struct is declared and never changed.  Small structs are searched
+//linearly by name handle; bigger ones get an open-addressed index.
+struct struct_layout{
+   const interned* name;
+   const field_desc* fields;
+   uint32_t size;            // number of fields
+   uint32_t bytes;           // size of the struct
+   const field_desc* find(const interned* field) const;
+   const field_desc* begin() const { return fields; }
+   const field_desc* end() const { return fields + size; }
+   static const uint32_t linear_limit = 8;
+   const uint32_t* index;    // ordinal + 1 per slot, 0 if empty
+   uint32_t index_mask;
 };
 
 struct symbol{
    bitset<ATTR_bitset_size> attributes;
-   symbol_table* fields;
-   symbol_table* ref;
+   const struct_layout* fields;
    location lloc;
    size_t block_nr;
-   vector<symbol*>* parameters;
-   string* ref_name;
+   param_list parameters;
+   // Symbols live in this arena for the whole compilation and are
+   // only freed by release(), along with the tables that hold them.
+   // Bindings and spilled parameter lists live in links, struct
+   // layouts in layouts.
+   static arena symbols;
+   static arena links;
+   static arena layouts;
+   static void release();
+   static void* operator new (size_t size);
+   // Locked, since function bodies are checked on several threads.
+   static void operator delete (void*) {}
+};
+//One declaration of a name.  Each interned name heads a list of
+//these in string_set::entry, innermost scope first.
+struct binding{
+   symbol* sym;
+   binding* shadowed;
+   unsigned order;           //when it was made, for worker threads
 };
 
 struct symbol_stack{
    vector<symbol_table*> symbol_stack;
+   //Bindings made in open scopes, and where each scope starts
+   vector<pair<const interned*,binding*>> trail;
+   vector<size_t> marks;
    int next_block = 1;
+   //A local stack keeps its bindings in heads rather than in the
+   //names themselves, and sees only the global bindings made before
+   //visible.  Function bodies are checked with one of these.
+   bool local = false;
+   unsigned visible = ~0u;
+   unordered_map<const interned*,binding*,interned_hash> heads;
   
-   symbol_table* pop();
-   void push(symbol* symbol,const string* key);
+   void pop();
+   void push(symbol* symbol,const interned* key);
    void push(symbol_table* table); 
+   binding* value(const interned* name);
+   binding* type(const interned* name);
+   private:
+      binding*& head(const interned* key);
+      binding* visible_of(binding* list);
 };
 
 symbol* type_to_symbol(astree* node, bool isArray = false);
-symbol* lookup(const string* name);
-symbol* lookup(astree* node);
+symbol* lookup(const interned* name);
+symbol* lookup_type(const interned* name);
+void bind_global(symbol* sym, const interned* key);
+void bind_type(symbol* sym, const interned* key);
 astree* call_lookup(astree* node);
-symbol_table* create_field_table(astree* node);
+const struct_layout* create_field_table(astree* node);
 bool is_both_ints(bitset<ATTR_bitset_size> left, bitset<ATTR_bitset_size> right);
 bool math_expr_check(astree* node);
 bool compatible(bitset<ATTR_bitset_size> left, bitset<ATTR_bitset_size> right);
-void semantic_analysis(astree* node);
+//With fold, int arithmetic, comparisons and !, - and + on int and
+//char constants are replaced by the int constant they come to.
+void semantic_analysis(astree* node, int threads = 1, bool fold = true);
 void destroy (astree* tree1, astree* tree2 = nullptr);
 void errllocprintf (const location&, const char* format, const char*);
-void make_oil_file();
-string make_oil_field(bitset<ATTR_bitset_size> bits,const string* type);
+void make_oil_file(const flat_tree* flat = nullptr, int threads = 1);
+//Most levels a line of the .ast file is indented, 0 for no limit.
+//Deeper lines start with #depth.
+extern int ast_indent_limit;
+void print_ast_node (outbuf& outfile, int symbol, const interned* lexinfo,
+                     const location& lloc, size_t block_nr,
+                     const bitset<ATTR_bitset_size>& attributes,
+                     const location& ref_loc, int depth);
+string make_oil_field(bitset<ATTR_bitset_size> bits,const interned* type);
+string make_oil_type(const astree* node);
 string vreg(astree* node);
 string func_codegen(astree* node);
 #endif
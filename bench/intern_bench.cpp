@@ -0,0 +1,61 @@
+// Contention benchmark for string_set::intern.
+//
+// Usage: intern_bench [max_threads] [distinct] [lookups]
+//
+// For each thread count from 1 up to max_threads (doubling), every
+// thread interns its share of a fresh batch of distinct strings
+// (insert heavy), then every thread looks up the whole batch again
+// (lookup only).  Reports millions of interns per second.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include "string_set.h"
+
+static double run (size_t threads, const vector<string>& words,
+                   size_t rounds) {
+   auto start = chrono::steady_clock::now();
+   vector<thread> workers;
+   for (size_t id = 0; id < threads; ++id) {
+      workers.emplace_back ([&words, threads, rounds, id] {
+         for (size_t round = 0; round < rounds; ++round) {
+            for (size_t word = id; word < words.size(); word += threads) {
+               string_set::intern (words[word].c_str());
+            }
+         }
+      });
+   }
+   for (auto& worker: workers) worker.join();
+   chrono::duration<double> elapsed
+         = chrono::steady_clock::now() - start;
+   return words.size() * rounds / elapsed.count() / 1e6;
+}
+
+int main (int argc, char** argv) {
+   size_t max_threads = argc > 1 ? atoi (argv[1])
+                                 : thread::hardware_concurrency();
+   size_t distinct = argc > 2 ? atoi (argv[2]) : 200000;
+   size_t lookups = argc > 3 ? atoi (argv[3]) : 10;
+   if (max_threads == 0) max_threads = 1;
+   printf ("%8s %14s %14s\n", "threads", "insert Mops/s", "lookup Mops/s");
+   for (size_t threads = 1; ; threads *= 2) {
+      if (threads > max_threads) threads = max_threads;
+      vector<string> words;
+      for (size_t word = 0; word < distinct; ++word) {
+         words.push_back ("t" + to_string (threads) + "_ident_"
+                          + to_string (word * 2654435761u));
+      }
+      double insert = run (threads, words, 1);
+      double lookup = run (threads, words, lookups);
+      printf ("%8zu %14.2f %14.2f\n", threads, insert, lookup);
+      if (threads == max_threads) break;
+   }
+   printf ("%zu strings interned\n", string_set::size());
+   return 0;
+}
+
@@ -0,0 +1,264 @@
+// Throughput benchmark driver for oc.
+//
+// Usage: ocbench [-o results.json] [-n repeats] [-l label]
+//                [-a oc_option]... oc program.oc...
+//
+// Compiles each program repeats times with oc --stats=json, each run
+// in the program's own directory, and keeps the fastest run.  Reports
+// lines/s, tokens/s (counted from the .tok file), user and system
+// time, peak RSS and oc's own per-phase times as tables on stdout,
+// and writes the same numbers as JSON so that runs of different
+// versions can be diffed.
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct result {
+   string file;
+   size_t bytes = 0;
+   size_t lines = 0;
+   size_t tokens = 0;
+   int status = 0;
+   double wall = 0;
+   double user = 0;
+   double system = 0;
+   long peak_rss_kb = 0;
+   string oc_stats;    // the object oc --stats=json printed
+};
+
+static double seconds (const timeval& time) {
+   return time.tv_sec + time.tv_usec / 1e6;
+}
+
+static bool count_lines (const string& path, size_t& bytes,
+                         size_t& lines, size_t& tokens) {
+   FILE* file = fopen (path.c_str(), "r");
+   if (file == nullptr) return false;
+   bytes = lines = tokens = 0;
+   bool line_start = true;
+   for (int byte; (byte = getc (file)) != EOF;) {
+      ++bytes;
+      // In a .tok file every line but the # markers is a token.
+      if (line_start and byte != '#') ++tokens;
+      line_start = byte == '\n';
+      if (line_start) ++lines;
+   }
+   fclose (file);
+   return true;
+}
+
+// One run of oc in dir.  Fills in the timing fields of out.
+static bool run_once (const string& oc, const vector<string>& options,
+                      const string& dir, const string& base,
+                      result& out) {
+   FILE* errors = tmpfile();
+   if (errors == nullptr) return false;
+   timespec start, finish;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   pid_t pid = fork();
+   if (pid < 0) return false;
+   if (pid == 0) {
+      if (chdir (dir.c_str()) != 0) _exit (127);
+      int null = open ("/dev/null", O_WRONLY);
+      dup2 (null, STDOUT_FILENO);
+      dup2 (fileno (errors), STDERR_FILENO);
+      vector<char*> argv;
+      argv.push_back (const_cast<char*> (oc.c_str()));
+      argv.push_back (const_cast<char*> ("--stats=json"));
+      for (const auto& option: options) {
+         argv.push_back (const_cast<char*> (option.c_str()));
+      }
+      argv.push_back (const_cast<char*> (base.c_str()));
+      argv.push_back (nullptr);
+      execv (oc.c_str(), argv.data());
+      _exit (127);
+   }
+   int status;
+   rusage usage;
+   if (wait4 (pid, &status, 0, &usage) != pid) return false;
+   clock_gettime (CLOCK_MONOTONIC, &finish);
+   out.status = status;
+   out.wall = finish.tv_sec - start.tv_sec
+            + (finish.tv_nsec - start.tv_nsec) / 1e9;
+   out.user = seconds (usage.ru_utime);
+   out.system = seconds (usage.ru_stime);
+   out.peak_rss_kb = usage.ru_maxrss;
+   // Pick oc's stats line out of whatever else went to stderr.
+   rewind (errors);
+   char line[0x1000];
+   const char prefix[] = "{\"oc_stats\": ";
+   while (fgets (line, sizeof line, errors) != nullptr) {
+      if (strncmp (line, prefix, sizeof prefix - 1) != 0) continue;
+      out.oc_stats = line + sizeof prefix - 1;
+      // Drop the closing brace of the wrapper and the newline.
+      size_t end = out.oc_stats.rfind ('}');
+      if (end != string::npos) out.oc_stats.erase (end);
+   }
+   fclose (errors);
+   return true;
+}
+
+// Prints "phase ms" pairs from the "phases" part of an oc_stats
+// object.
+static void print_phases (const string& oc_stats) {
+   size_t pos = oc_stats.find ("\"phases\": {");
+   if (pos == string::npos) return;
+   size_t end = oc_stats.find ("}}", pos);
+   printf ("%24s", "");
+   while ((pos = oc_stats.find ("\"seconds\": ", pos)) < end) {
+      size_t name_end = oc_stats.rfind ('"', oc_stats.rfind (':', pos));
+      size_t name_start = oc_stats.rfind ('"', name_end - 1) + 1;
+      double seconds = atof (oc_stats.c_str() + pos + 11);
+      printf (" %s %.1f", oc_stats.substr (name_start,
+              name_end - name_start).c_str(), seconds * 1e3);
+      pos += 11;
+   }
+   printf ("  (ms)\n");
+}
+
+static string quoted (const string& text) {
+   string result = "\"";
+   for (char byte: text) {
+      if (byte == '"' or byte == '\\') {
+         result += '\\';
+         result += byte;
+      }else if (static_cast<unsigned char> (byte) < ' ') {
+         char escape[8];
+         snprintf (escape, sizeof escape, "\\u%04x", byte);
+         result += escape;
+      }else {
+         result += byte;
+      }
+   }
+   return result + "\"";
+}
+
+static void print_json (FILE* out, const string& label,
+                        const string& oc, const vector<string>& options,
+                        int repeats, const vector<result>& results) {
+   fprintf (out, "{\n  \"label\": %s,\n  \"oc\": %s,\n",
+            quoted (label).c_str(), quoted (oc).c_str());
+   fprintf (out, "  \"options\": [");
+   for (size_t index = 0; index < options.size(); ++index) {
+      fprintf (out, "%s%s", index ? ", " : "",
+               quoted (options[index]).c_str());
+   }
+   fprintf (out, "],\n  \"repeats\": %d,\n  \"files\": [\n", repeats);
+   for (size_t index = 0; index < results.size(); ++index) {
+      const result& run = results[index];
+      fprintf (out, "    {\"file\": %s, \"bytes\": %zu,"
+               " \"lines\": %zu, \"tokens\": %zu, \"status\": %d,\n",
+               quoted (run.file).c_str(), run.bytes, run.lines,
+               run.tokens, run.status);
+      fprintf (out, "     \"wall_s\": %.6f, \"user_s\": %.6f,"
+               " \"sys_s\": %.6f, \"peak_rss_kb\": %ld,\n",
+               run.wall, run.user, run.system, run.peak_rss_kb);
+      fprintf (out, "     \"lines_per_s\": %.0f,"
+               " \"tokens_per_s\": %.0f",
+               run.lines / run.wall, run.tokens / run.wall);
+      if (not run.oc_stats.empty()) {
+         fprintf (out, ",\n     \"oc_stats\": %s", run.oc_stats.c_str());
+      }
+      fprintf (out, "}%s\n", index + 1 < results.size() ? "," : "");
+   }
+   fprintf (out, "  ]\n}\n");
+}
+
+int main (int argc, char** argv) {
+   const char* json = nullptr;
+   int repeats = 3;
+   string label;
+   vector<string> options;
+   int opt;
+   while ((opt = getopt (argc, argv, "+o:n:l:a:")) != -1) {
+      switch (opt) {
+         case 'o': json = optarg; break;
+         case 'n': repeats = atoi (optarg); break;
+         case 'l': label = optarg; break;
+         case 'a': options.push_back (optarg); break;
+         default:
+            fprintf (stderr, "Usage: %s [-o results.json] [-n repeats]"
+                     " [-l label] [-a oc_option]... oc program.oc...\n",
+                     argv[0]);
+            return 1;
+      }
+   }
+   if (optind + 2 > argc or repeats < 1) {
+      fprintf (stderr, "%s: need oc and at least one program\n",
+               argv[0]);
+      return 1;
+   }
+   char oc[PATH_MAX];
+   if (realpath (argv[optind], oc) == nullptr) {
+      perror (argv[optind]);
+      return 1;
+   }
+
+   vector<result> results;
+   printf ("%-24s %9s %9s %8s %12s %12s %10s\n", "file", "lines",
+           "tokens", "wall s", "lines/s", "tokens/s", "peak KB");
+   for (int arg = optind + 1; arg < argc; ++arg) {
+      result best;
+      best.file = argv[arg];
+      vector<char> path_dir (best.file.begin(), best.file.end());
+      path_dir.push_back ('\0');
+      vector<char> path_base (path_dir);
+      string dir = dirname (path_dir.data());
+      string base = basename (path_base.data());
+      size_t ignored;
+      if (not count_lines (best.file, best.bytes, best.lines, ignored)) {
+         perror (best.file.c_str());
+         return 1;
+      }
+      for (int repeat = 0; repeat < repeats; ++repeat) {
+         result run;
+         if (not run_once (oc, options, dir, base, run)) {
+            perror ("fork");
+            return 1;
+         }
+         if (repeat == 0 or run.wall < best.wall) {
+            best.wall = run.wall;
+            best.user = run.user;
+            best.system = run.system;
+            best.status = run.status;
+            best.oc_stats = run.oc_stats;
+         }
+         if (run.peak_rss_kb > best.peak_rss_kb) {
+            best.peak_rss_kb = run.peak_rss_kb;
+         }
+      }
+      string tok = dir + "/" + base.substr (0, base.find ('.')) + ".tok";
+      size_t tok_bytes, tok_lines;
+      count_lines (tok, tok_bytes, tok_lines, best.tokens);
+      printf ("%-24s %9zu %9zu %8.3f %12.0f %12.0f %10ld%s\n",
+              base.c_str(), best.lines, best.tokens, best.wall,
+              best.lines / best.wall, best.tokens / best.wall,
+              best.peak_rss_kb, best.status ? "  (failed)" : "");
+      print_phases (best.oc_stats);
+      results.push_back (best);
+   }
+   if (json != nullptr) {
+      FILE* out = fopen (json, "w");
+      if (out == nullptr) {
+         perror (json);
+         return 1;
+      }
+      print_json (out, label, oc, options, repeats, results);
+      fclose (out);
+      printf ("results written to %s\n", json);
+   }
+   return 0;
+}
+
@@ -0,0 +1,167 @@
+// Generator of synthetic oc programs for the compiler benchmark.
+//
+// Usage: ocgen [-f functions] [-s structs] [-e expr_depth]
+//              [-l literals] [-n nesting] [-d deep] [-r seed]
+//
+// Writes one program to stdout: structs with int, string and struct
+// fields, string literal globals, then functions whose bodies
+// allocate a struct, evaluate random expressions of the given depth
+// over their parameters and earlier functions, and nest while and
+// if/else blocks to the given depth.  -d adds a global initialized by
+// one expression nested deep levels, 1 + (1 + (... + (1))), to stress
+// the parser and tree walks.  The same arguments always give the same
+// program.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+using namespace std;
+
+struct options {
+   long functions = 100;
+   long structs = 10;
+   long expr_depth = 3;
+   long literals = 20;
+   long nesting = 2;
+   long deep = 0;
+   unsigned long seed = 1;
+};
+
+static unsigned long state;
+
+static unsigned long next_random() {
+   // xorshift64*
+   state ^= state >> 12;
+   state ^= state << 25;
+   state ^= state >> 27;
+   return state * 2685821657736338717ULL;
+}
+
+static long pick (long limit) {
+   return limit <= 0 ? 0 : long (next_random() % limit);
+}
+
+static string argument() {
+   switch (pick (3)) {
+      case 0:  return "a";
+      case 1:  return "b";
+      default: return to_string (pick (100));
+   }
+}
+
+static string expression (int depth, long function) {
+   if (depth <= 0) {
+      switch (pick (4)) {
+         case 0:  return "a";
+         case 1:  return "b";
+         case 2:  return "p.n";
+         default: return to_string (pick (100));
+      }
+   }
+   if (function > 0 and pick (6) == 0) {
+      // Only plain names and constants as arguments; oc's argument
+      // check rejects anything else.
+      return "f" + to_string (pick (function)) + "(" + argument()
+             + ", " + argument() + ")";
+   }
+   static const char* const operators[] = {"+", "-", "*", "/"};
+   return "(" + expression (depth - 1, function) + " "
+          + operators[pick (4)] + " "
+          + expression (depth - 1, function) + ")";
+}
+
+static void indent (int level) {
+   for (int space = 0; space < level; ++space) fputs ("   ", stdout);
+}
+
+static void nested (int level, int depth, const options& opts,
+                    long function) {
+   if (depth == 0) {
+      indent (level);
+      printf ("v = v + %s;\n",
+              expression (opts.expr_depth, function).c_str());
+      return;
+   }
+   indent (level);
+   if (depth % 2 == 0) {
+      printf ("while (v < %ld) {\n", 100 + pick (1000));
+      nested (level + 1, depth - 1, opts, function);
+      indent (level + 1);
+      printf ("v = v + 1;\n");
+   }else {
+      printf ("if (v == %ld) {\n", pick (50));
+      nested (level + 1, depth - 1, opts, function);
+      indent (level);
+      printf ("}else {\n");
+      indent (level + 1);
+      printf ("v = v - 1;\n");
+   }
+   indent (level);
+   printf ("}\n");
+}
+
+static void generate (const options& opts) {
+   long structs = opts.structs > 0 ? opts.structs : 1;
+   for (long id = 0; id < structs; ++id) {
+      printf ("struct s%ld { int n; string name;", id);
+      if (id > 0) printf (" s%ld link;", pick (id));
+      printf (" }\n");
+   }
+   for (long id = 0; id < opts.literals; ++id) {
+      printf ("string str%ld = \"literal %ld: \\\"%08lx\\\"\\n\";\n",
+              id, id, next_random() & 0xffffffff);
+   }
+   for (long id = 0; id < opts.functions; ++id) {
+      long type = pick (structs);
+      printf ("int f%ld(int a, int b) {\n", id);
+      printf ("   s%ld p = new s%ld();\n", type, type);
+      string init = expression (opts.expr_depth, id);
+      printf ("   p.n = %s;\n", init.c_str());
+      if (opts.literals > 0) {
+         printf ("   p.name = str%ld;\n", pick (opts.literals));
+      }
+      init = expression (opts.expr_depth, id);
+      printf ("   int v = %s;\n", init.c_str());
+      nested (1, opts.nesting, opts, id);
+      printf ("   return v;\n");
+      printf ("}\n");
+   }
+   if (opts.functions > 0) {
+      printf ("int result = f%ld(1, 2);\n", opts.functions - 1);
+   }
+   if (opts.deep > 0) {
+      printf ("int deep = ");
+      for (long level = 0; level < opts.deep; ++level) {
+         fputs ("1 + (", stdout);
+      }
+      printf ("1");
+      for (long level = 0; level < opts.deep; ++level) putchar (')');
+      printf (";\n");
+   }
+}
+
+int main (int argc, char** argv) {
+   options opts;
+   int opt;
+   while ((opt = getopt (argc, argv, "f:s:e:l:n:d:r:")) != -1) {
+      switch (opt) {
+         case 'f': opts.functions = atol (optarg); break;
+         case 's': opts.structs = atol (optarg); break;
+         case 'e': opts.expr_depth = atol (optarg); break;
+         case 'l': opts.literals = atol (optarg); break;
+         case 'n': opts.nesting = atol (optarg); break;
+         case 'd': opts.deep = atol (optarg); break;
+         case 'r': opts.seed = strtoul (optarg, nullptr, 0); break;
+         default:
+            fprintf (stderr, "Usage: %s [-f functions] [-s structs]"
+                     " [-e expr_depth] [-l literals] [-n nesting]"
+                     " [-d deep] [-r seed]\n", argv[0]);
+            return 1;
+      }
+   }
+   state = opts.seed * 0x9e3779b97f4a7c15ULL + 1;
+   generate (opts);
+   return 0;
+}
+
@@ -0,0 +1,255 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "auxlib.h"
+#include "cache.h"
+#include "mapfile.h"
+
+string compile_cache::directory;
+size_t compile_cache::size_limit = 64 << 20;
+
+static const char* const suffixes[] = {
+   ".tok", ".ast", ".sym", ".oil", ".str",
+};
+static const char entry_magic[] = "oc-cache 1\n";
+static const size_t key_length = 32;
+
+// Counters kept in the stats file, in file order.
+enum { HITS, MISSES, STORES, EVICTIONS, COUNTERS };
+static const char* const counter_names[COUNTERS] = {
+   "hits", "misses", "stores", "evictions",
+};
+
+// Adds delta to the counters under an exclusive lock on the stats
+// file and leaves the new totals in totals.
+static void update_counters (const long delta[COUNTERS],
+                             long totals[COUNTERS]) {
+   for (int counter = 0; counter < COUNTERS; ++counter) {
+      totals[counter] = 0;
+   }
+   string path = compile_cache::directory + "/stats";
+   int fd = open (path.c_str(), O_RDWR | O_CREAT, 0666);
+   if (fd < 0) return;
+   flock (fd, LOCK_EX);
+   char buffer[0x400];
+   ssize_t count = pread (fd, buffer, sizeof buffer - 1, 0);
+   buffer[count > 0 ? count : 0] = '\0';
+   char* line = buffer;
+   for (int counter = 0; counter < COUNTERS; ++counter) {
+      char name[32];
+      long value;
+      int used;
+      if (sscanf (line, "%31s %ld\n%n", name, &value, &used) != 2) break;
+      if (strcmp (name, counter_names[counter]) == 0) {
+         totals[counter] = value;
+      }
+      line += used;
+   }
+   string text;
+   for (int counter = 0; counter < COUNTERS; ++counter) {
+      totals[counter] += delta[counter];
+      text += string (counter_names[counter]) + " "
+            + to_string (totals[counter]) + "\n";
+   }
+   if (ftruncate (fd, 0) == 0) {
+      ssize_t written = pwrite (fd, text.data(), text.size(), 0);
+      (void) written;
+   }
+   flock (fd, LOCK_UN);
+   close (fd);
+}
+
+static void count (int counter, long amount = 1) {
+   if (amount == 0) return;
+   long delta[COUNTERS] = {};
+   long totals[COUNTERS];
+   delta[counter] = amount;
+   update_counters (delta, totals);
+}
+
+static bool is_entry_name (const char* name) {
+   if (strlen (name) != key_length) return false;
+   for (const char* digit = name; *digit; ++digit) {
+      if (not isxdigit (static_cast<unsigned char> (*digit))) return false;
+   }
+   return true;
+}
+
+static bool write_file (const string& path, const char* data,
+                        size_t len) {
+   FILE* outfile = fopen (path.c_str(), "w");
+   if (outfile == nullptr) return false;
+   bool ok = fwrite (data, 1, len, outfile) == len;
+   return fclose (outfile) == 0 and ok;
+}
+
+string compile_cache::key (const string& flags, const char* text,
+                           size_t len) {
+   // 128-bit FNV-1a over the flags, a NUL, and the text.
+   using uint128 = unsigned __int128;
+   const uint128 prime = (uint128 (1) << 88) + 0x13b;
+   uint128 hash = (uint128 (0x6c62272e07bb0142ULL) << 64)
+                | 0x62b821756295c58dULL;
+   auto mix = [&] (const char* bytes, size_t count) {
+      for (size_t pos = 0; pos < count; ++pos) {
+         hash ^= static_cast<unsigned char> (bytes[pos]);
+         hash *= prime;
+      }
+   };
+   mix (flags.c_str(), flags.size() + 1);
+   mix (text, len);
+   char digest[key_length + 1];
+   snprintf (digest, sizeof digest, "%016llx%016llx",
+             static_cast<unsigned long long> (hash >> 64),
+             static_cast<unsigned long long> (hash));
+   return digest;
+}
+
+const string& compile_cache::compiler() {
+   static const string digest = [] {
+      mapfile self;
+      if (not self.open ("/proc/self/exe")) return string();
+      return key ("", self.data(), self.size());
+   }();
+   return digest;
+}
+
+bool compile_cache::restore (const string& key, const string& base) {
+   mapfile entry;
+   string path = directory + "/" + key;
+   if (not entry.open (path)) {
+      count (MISSES);
+      return false;
+   }
+   const char* data = entry.data();
+   size_t size = entry.size();
+   size_t magic_length = sizeof entry_magic - 1;
+   bool ok = size >= magic_length
+             and memcmp (data, entry_magic, magic_length) == 0;
+   size_t pos = magic_length;
+   for (const char* suffix: suffixes) {
+      if (not ok) break;
+      const char* newline = static_cast<const char*> (
+            memchr (data + pos, '\n', size - pos));
+      char name[8];
+      size_t length;
+      ok = newline != nullptr
+           and sscanf (data + pos, "%7s %zu\n", name, &length) == 2
+           and strcmp (name, suffix) == 0
+           and length <= size - (newline + 1 - data);
+      if (not ok) break;
+      pos = newline + 1 - data;
+      ok = write_file (base + suffix, data + pos, length);
+      pos += length;
+   }
+   if (not ok) {
+      // A damaged entry is dropped and recompiled.
+      unlink (path.c_str());
+      count (MISSES);
+      return false;
+   }
+   // Touch the entry so eviction sees it as recently used.
+   utimensat (AT_FDCWD, path.c_str(), nullptr, 0);
+   count (HITS);
+   return true;
+}
+
+void compile_cache::store (const string& key, const string& base) {
+   string entry = entry_magic;
+   for (const char* suffix: suffixes) {
+      mapfile output;
+      if (not output.open (base + suffix)) return;
+      entry += string (suffix) + " " + to_string (output.size()) + "\n";
+      entry.append (output.data(), output.size());
+   }
+   if (mkdir (directory.c_str(), 0777) != 0 and errno != EEXIST) {
+      syserrprintf (directory.c_str());
+      return;
+   }
+   string path = directory + "/" + key;
+   string temporary = path + "." + to_string (getpid());
+   if (not write_file (temporary, entry.data(), entry.size())
+       or rename (temporary.c_str(), path.c_str()) != 0) {
+      unlink (temporary.c_str());
+      return;
+   }
+
+   struct cached {
+      string path;
+      off_t size;
+      struct timespec used;
+   };
+   vector<cached> entries;
+   size_t total = 0;
+   DIR* dir = opendir (directory.c_str());
+   if (dir == nullptr) return;
+   while (dirent* found = readdir (dir)) {
+      if (not is_entry_name (found->d_name)) continue;
+      struct stat info;
+      string name = directory + "/" + found->d_name;
+      if (stat (name.c_str(), &info) != 0) continue;
+      entries.push_back ({name, info.st_size, info.st_mtim});
+      total += info.st_size;
+   }
+   closedir (dir);
+   long evicted = 0;
+   if (total > size_limit) {
+      sort (entries.begin(), entries.end(),
+            [] (const cached& a, const cached& b) {
+               if (a.used.tv_sec != b.used.tv_sec) {
+                  return a.used.tv_sec < b.used.tv_sec;
+               }
+               return a.used.tv_nsec < b.used.tv_nsec;
+            });
+      for (const auto& victim: entries) {
+         if (total <= size_limit) break;
+         if (unlink (victim.path.c_str()) != 0) continue;
+         total -= victim.size;
+         ++evicted;
+      }
+   }
+   long delta[COUNTERS] = {};
+   long totals[COUNTERS];
+   delta[STORES] = 1;
+   delta[EVICTIONS] = evicted;
+   update_counters (delta, totals);
+}
+
+void compile_cache::print_stats (FILE* outfile) {
+   long delta[COUNTERS] = {};
+   long totals[COUNTERS];
+   update_counters (delta, totals);
+   size_t entries = 0;
+   size_t bytes = 0;
+   if (DIR* dir = opendir (directory.c_str())) {
+      while (dirent* found = readdir (dir)) {
+         if (not is_entry_name (found->d_name)) continue;
+         struct stat info;
+         string name = directory + "/" + found->d_name;
+         if (stat (name.c_str(), &info) != 0) continue;
+         ++entries;
+         bytes += info.st_size;
+      }
+      closedir (dir);
+   }
+   long lookups = totals[HITS] + totals[MISSES];
+   fprintf (outfile, "cache %s\n", directory.c_str());
+   fprintf (outfile, "   hits      %8ld (%.1f%%)\n", totals[HITS],
+            lookups == 0 ? 0.0 : 100.0 * totals[HITS] / lookups);
+   fprintf (outfile, "   misses    %8ld\n", totals[MISSES]);
+   fprintf (outfile, "   stores    %8ld\n", totals[STORES]);
+   fprintf (outfile, "   evictions %8ld\n", totals[EVICTIONS]);
+   fprintf (outfile, "   entries   %8zu\n", entries);
+   fprintf (outfile, "   bytes     %8zu of %zu\n", bytes, size_limit);
+}
+
@@ -0,0 +1,47 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <string>
+using namespace std;
+
+//
+// DESCRIPTION
+//    On-disk cache of compiler outputs, addressed by a hash of the
+//    preprocessed source and the flags that affect the outputs.  Each
+//    entry is one file in the cache directory holding the .tok, .ast,
+//    .sym, .oil and .str files of one compile.  Entries are written
+//    to a temporary name and renamed into place, so concurrent
+//    compiles can share a directory.  When the directory grows past
+//    its size limit, the least recently used entries are removed.
+//    Hit, miss, store and eviction counts are kept in a "stats" file
+//    next to the entries.
+//
+
+struct compile_cache {
+   static string directory;     // empty when there is no cache
+   static size_t size_limit;    // bytes of entries to keep
+
+   static string key (const string& flags, const char* text,
+                      size_t len);
+   // Hex digest naming the entry for this source and flags.
+
+   static const string& compiler();
+   // Digest of the running oc binary, read once, for the flags of
+   // every key, so a rebuilt oc does not reuse the old one's outputs.
+   // Empty if the binary can not be read, and then nothing should be
+   // cached.
+
+   static bool restore (const string& key, const string& base);
+   // On a hit, writes base.tok, base.ast, ... from the entry and
+   // returns true.  Counts the hit or the miss.
+
+   static void store (const string& key, const string& base);
+   // Saves base.tok, base.ast, ... under key, then evicts entries
+   // until the directory fits in size_limit.
+
+   static void print_stats (FILE* outfile);
+};
+
+#endif
+
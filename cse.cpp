@@ -0,0 +1,157 @@
+#include <unordered_map>
+
+#include "ssa.h"
+
+//
+// DESCRIPTION
+//    Common subexpressions, by value numbering within each block.  An
+//    arithmetic instruction, a field or index load, or a copy is
+//    looked up by its opcode and operands, and if the block already
+//    computed the same thing, uses of its vreg are pointed at the
+//    earlier one and it is deleted.  In SSA form, vregs never change,
+//    so only what is read from memory or from globals can go stale:
+//    stores, calls and assignments to globals end the reuse of the
+//    loads and global reads they could change.
+//
+
+namespace {
+
+enum depends : uint8_t { ON_FIELDS = 1, ON_ELEMENTS = 2,
+                         ON_GLOBALS = 4 };
+
+struct expr_key {
+   ir_instr::opcode op;
+   vreg_kind type;
+   ir_value a, b;
+   uint32_t field;
+   const struct_layout* layout;
+   bool operator== (const expr_key& that) const {
+      return op == that.op and type == that.type and a == that.a
+         and b == that.b and field == that.field
+         and layout == that.layout;
+   }
+};
+
+struct expr_hash {
+   size_t operator() (const expr_key& key) const {
+      size_t sum = key.op * 31 + key.type;
+      sum = sum * 1000003 + key.a.what * 31 + key.a.index;
+      sum = sum * 1000003 + key.b.what * 31 + key.b.index;
+      sum = sum * 1000003 + key.field;
+      return sum ^ hash<const struct_layout*>() (key.layout);
+   }
+};
+
+struct expr_entry {
+   uint32_t vreg;
+   uint8_t deps;
+   uint32_t epoch[3];   // of fields, elements and globals when found
+};
+
+}
+
+// Whether instr computes a value from its operands alone, apart from
+// memory and globals.  Anything that reads a text, such as new, is not.
+static bool is_expression (const ir_instr& instr) {
+   if (instr.dest.what != ir_value::VREG) return false;
+   switch (instr.op) {
+      case ir_instr::COPY:
+      case ir_instr::ADD: case ir_instr::SUB: case ir_instr::MUL:
+      case ir_instr::DIV: case ir_instr::REM:
+      case ir_instr::LT: case ir_instr::LE: case ir_instr::GT:
+      case ir_instr::GE: case ir_instr::EQ: case ir_instr::NE:
+      case ir_instr::NEG: case ir_instr::NOT:
+      case ir_instr::LOAD_FIELD:
+      case ir_instr::LOAD_INDEX:
+         return instr.a.what != ir_value::TEXT
+            and instr.b.what != ir_value::TEXT;
+      default:
+         return false;
+   }
+}
+
+static bool operand_less (const ir_value& a, const ir_value& b) {
+   return a.what != b.what ? a.what < b.what : a.index < b.index;
+}
+
+void eliminate_common (ir_function& fn) {
+   uint32_t vregs = fn.vregs + 1;
+   static thread_local unordered_map<expr_key, expr_entry, expr_hash>
+         table;
+   static thread_local vector<uint32_t> same;
+   same.assign (vregs, 0);
+   bool found = false;
+   auto rename = [&] (ir_value& value) {
+      if (value.what == ir_value::VREG and same[value.index] != 0) {
+         value.index = same[value.index];
+      }
+   };
+   for (ir_block& block: fn.blocks) {
+      table.clear();
+      uint32_t epoch[3] = {0, 0, 0};
+      vector<ir_instr>& code = block.code;
+      size_t kept = 0;
+      for (size_t nr = 0; nr < code.size(); ++nr) {
+         ir_instr& instr = code[nr];
+         for_each_use (fn, instr, rename);
+         switch (instr.op) {
+            case ir_instr::STORE_FIELD: ++epoch[0]; break;
+            case ir_instr::STORE_INDEX: ++epoch[1]; break;
+            case ir_instr::CALL:
+               ++epoch[0]; ++epoch[1]; ++epoch[2];
+               break;
+            case ir_instr::COPY:
+               if (instr.dest.what == ir_value::VAR) ++epoch[2];
+               break;
+            default:
+               break;
+         }
+         if (is_expression (instr)) {
+            expr_key key {instr.op, instr.type, instr.a, instr.b, 0,
+                          nullptr};
+            bool commutes = instr.op == ir_instr::ADD
+                  or instr.op == ir_instr::MUL or instr.op == ir_instr::EQ
+                  or instr.op == ir_instr::NE;
+            if (commutes and operand_less (key.b, key.a)) {
+               swap (key.a, key.b);
+            }
+            uint8_t deps = 0;
+            if (instr.op == ir_instr::LOAD_FIELD) {
+               key.field = instr.aux[0];
+               key.layout = instr.layout;
+               deps |= ON_FIELDS;
+            }
+            if (instr.op == ir_instr::LOAD_INDEX) deps |= ON_ELEMENTS;
+            if (instr.a.what == ir_value::VAR
+                or instr.b.what == ir_value::VAR) {
+               deps |= ON_GLOBALS;
+            }
+            auto entry = table.find (key);
+            bool current = entry != table.end();
+            for (int kind = 0; current and kind < 3; ++kind) {
+               if (entry->second.deps & (1 << kind)
+                   and entry->second.epoch[kind] != epoch[kind]) {
+                  current = false;
+               }
+            }
+            if (current) {
+               same[instr.dest.index] = entry->second.vreg;
+               ++fn.removed.common;
+               found = true;
+               continue;
+            }
+            table[key] = {instr.dest.index, deps,
+                          {epoch[0], epoch[1], epoch[2]}};
+         }
+         if (kept != nr) code[kept] = instr;
+         ++kept;
+      }
+      code.resize (kept);
+   }
+   if (not found) return;
+   // A deleted vreg can still be read by a phi or a block that came
+   // earlier in the scan than the one that set it.
+   for (ir_block& block: fn.blocks) {
+      for (ir_instr& instr: block.code) for_each_use (fn, instr, rename);
+   }
+}
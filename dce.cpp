@@ -0,0 +1,174 @@
+#include <algorithm>
+
+#include "ssa.h"
+
+//
+// DESCRIPTION
+//    Dead code.  In SSA form, an instruction is kept only if it has an
+//    effect, a store, a call or a jump, or if a kept instruction reads
+//    what it sets; the rest are temporaries nothing needs.  Once the
+//    phis are gone, blocks that only pass control on are taken out of
+//    the jumps to them, and blocks no jump reaches, which constant
+//    propagation left empty, are deleted.
+//
+
+static const uint32_t no_block = ir_function::no_block;
+
+static bool has_effect (const ir_instr& instr) {
+   switch (instr.op) {
+      case ir_instr::STORE_FIELD:
+      case ir_instr::STORE_INDEX:
+      case ir_instr::CALL:
+      case ir_instr::JUMP:
+      case ir_instr::BRANCH:
+      case ir_instr::RETURN:
+         return true;
+      default:
+         // A copy to a variable that is still one is a global's.
+         return instr.dest.what != ir_value::VREG;
+   }
+}
+
+void remove_dead_code (ir_function& fn) {
+   uint32_t vregs = fn.vregs + 1;
+   static thread_local vector<const ir_instr*> def_of;
+   static thread_local vector<bool> live;
+   static thread_local vector<uint32_t> work;
+   def_of.assign (vregs, nullptr);
+   live.assign (vregs, false);
+   work.clear();
+   auto mark = [&] (const ir_value& value) {
+      if (value.what != ir_value::VREG or live[value.index]) return;
+      live[value.index] = true;
+      work.push_back (value.index);
+   };
+   for (const ir_block& block: fn.blocks) {
+      for (const ir_instr& instr: block.code) {
+         if (instr.dest.what == ir_value::VREG) {
+            def_of[instr.dest.index] = &instr;
+         }
+         if (has_effect (instr)) for_each_use (fn, instr, mark);
+      }
+   }
+   while (not work.empty()) {
+      const ir_instr* instr = def_of[work.back()];
+      work.pop_back();
+      if (instr != nullptr) for_each_use (fn, *instr, mark);
+   }
+   for (ir_block& block: fn.blocks) {
+      vector<ir_instr>& code = block.code;
+      size_t size = code.size();
+      code.erase (remove_if (code.begin(), code.end(),
+                             [&] (ir_instr& instr) {
+                                if (instr.dest.what != ir_value::VREG
+                                    or live[instr.dest.index]) {
+                                   return false;
+                                }
+                                if (instr.op != ir_instr::CALL) return true;
+                                instr.dest = ir_value::none();
+                                return false;
+                             }),
+                  code.end());
+      fn.removed.temps += size - code.size();
+   }
+}
+
+//
+// Out of SSA, so a block can be skipped without fixing phis.  Every
+// kept block that falls through gets an explicit jump first, since
+// the block after it may be deleted.
+//
+
+void simplify_blocks (ir_function& fn) {
+   uint32_t blocks = fn.blocks.size();
+   static thread_local vector<uint32_t> forward, place;
+   forward.resize (blocks);
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      const vector<ir_instr>& code = fn.blocks[nr].code;
+      forward[nr] = nr;
+      if (nr == 0) continue;
+      if (code.empty()) {
+         if (nr + 1 < blocks) forward[nr] = nr + 1;
+      }else if (code.size() == 1 and code[0].op == ir_instr::JUMP) {
+         forward[nr] = code[0].aux[0];
+      }
+   }
+   // Follows a chain of blocks that only jump to where it ends, and
+   // makes every block on it point there.  An empty loop with no exit
+   // ends where it started.
+   auto resolve = [&] (uint32_t nr) {
+      uint32_t end = nr;
+      for (uint32_t steps = 0; forward[end] != end and steps < blocks;
+           ++steps) {
+         end = forward[end];
+      }
+      while (forward[nr] != end and forward[nr] != nr) {
+         uint32_t next = forward[nr];
+         forward[nr] = end;
+         nr = next;
+      }
+      return end;
+   };
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      vector<ir_instr>& code = fn.blocks[nr].code;
+      if (code.empty() or not code.back().is_terminator()) {
+         if (nr + 1 >= blocks) continue;
+         ir_instr jump;
+         jump.op = ir_instr::JUMP;
+         jump.type = VREG_INT;
+         jump.ctype = 0;
+         jump.dest = jump.a = jump.b = jump.c = ir_value::none();
+         jump.aux[0] = nr + 1;
+         jump.aux[1] = 0;
+         jump.layout = nullptr;
+         code.push_back (jump);
+      }
+      ir_instr& last = code.back();
+      if (last.op == ir_instr::JUMP) {
+         last.aux[0] = resolve (last.aux[0]);
+      }else if (last.op == ir_instr::BRANCH) {
+         last.aux[0] = resolve (last.aux[0]);
+         last.aux[1] = resolve (last.aux[1]);
+         if (last.aux[0] == last.aux[1]) {
+            last.op = ir_instr::JUMP;
+            last.a = ir_value::none();
+         }
+      }
+   }
+
+   // Keeps the blocks a jump still reaches from the entry.
+   place.assign (blocks, no_block);
+   static thread_local vector<uint32_t> work;
+   work.assign (1, 0);
+   place[0] = 0;
+   while (not work.empty()) {
+      uint32_t nr = work.back();
+      work.pop_back();
+      uint32_t next[2];
+      int count = fn.successors (nr, next);
+      for (int succ = 0; succ < count; ++succ) {
+         if (place[next[succ]] != no_block) continue;
+         place[next[succ]] = 0;
+         work.push_back (next[succ]);
+      }
+   }
+   uint32_t kept = 0;
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      if (place[nr] == no_block) continue;
+      place[nr] = kept;
+      if (kept != nr) swap (fn.blocks[kept], fn.blocks[nr]);
+      ++kept;
+   }
+   fn.removed.blocks += blocks - kept;
+   fn.blocks.resize (kept);
+   for (ir_block& block: fn.blocks) {
+      if (block.code.empty()) continue;
+      ir_instr& last = block.code.back();
+      if (last.op == ir_instr::JUMP) {
+         last.aux[0] = place[last.aux[0]];
+      }else if (last.op == ir_instr::BRANCH) {
+         last.aux[0] = place[last.aux[0]];
+         last.aux[1] = place[last.aux[1]];
+      }
+   }
+}
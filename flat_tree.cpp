@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <utility>
+
+#include "flat_tree.h"
+
+constexpr uint32_t flat_tree::none;
+
+void flat_tree::clear() {
+   first_child.clear();
+   next_sibling.clear();
+   depth.clear();
+   symbol.clear();
+   lloc.clear();
+   lexinfo.clear();
+   attributes.clear();
+   block_nr.clear();
+   ref_loc.clear();
+   string_con.clear();
+}
+
+void flat_tree::build (astree* root) {
+   clear();
+   vector<uint32_t> last_child;
+   vector<pair<astree*,uint32_t>> work {{root, none}};
+   while (not work.empty()) {
+      astree* node = work.back().first;
+      uint32_t parent = work.back().second;
+      work.pop_back();
+      assert (symbol.size() < none);
+      uint32_t index = symbol.size();
+      first_child.push_back (none);
+      next_sibling.push_back (none);
+      last_child.push_back (none);
+      if (parent == none) {
+         depth.push_back (0);
+      }else {
+         depth.push_back (depth[parent] + 1);
+         if (last_child[parent] == none) {
+            first_child[parent] = index;
+         }else {
+            next_sibling[last_child[parent]] = index;
+         }
+         last_child[parent] = index;
+      }
+      symbol.push_back (node->symbol);
+      lloc.push_back (node->lloc);
+      lexinfo.push_back (node->lexinfo);
+      attributes.push_back (node->attributes);
+      block_nr.push_back (node->block_nr);
+      ref_loc.push_back (node->ref_loc);
+      string_con.push_back (&node->string_con);
+      for (auto child = node->children.rbegin();
+           child != node->children.rend(); ++child) {
+         work.push_back ({*child, index});
+      }
+   }
+}
+
+void flat_tree::print (outbuf& outfile) const {
+   for (uint32_t node = 0; node < size(); ++node) {
+      print_ast_node (outfile, symbol[node], lexinfo[node], lloc[node],
+                      block_nr[node], attributes[node], ref_loc[node],
+                      depth[node]);
+   }
+}
+
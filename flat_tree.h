@@ -0,0 +1,47 @@
+#ifndef __FLAT_TREE_H__
+#define __FLAT_TREE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <bitset>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "astree.h"
+
+//
+// DESCRIPTION
+//    Flattened copy of an astree.  Nodes are stored in pre-order in
+//    parallel arrays indexed by a 32-bit node number, so a pass that
+//    only needs a few fields walks them linearly instead of chasing
+//    children pointers.  Node 0 is the root.
+//
+
+struct flat_tree {
+   static constexpr uint32_t none = UINT32_MAX;
+
+   // Links.
+   vector<uint32_t> first_child;
+   vector<uint32_t> next_sibling;
+   vector<uint32_t> depth;
+   // Per-field side arrays.
+   vector<int> symbol;
+   vector<location> lloc;
+   vector<const interned*> lexinfo;
+   vector<bitset<ATTR_bitset_size>> attributes;
+   vector<size_t> block_nr;
+   vector<location> ref_loc;
+   vector<const string*> string_con;
+
+   void build (astree* root);
+   // Replaces the contents with a pre-order copy of root.
+
+   uint32_t size() const { return symbol.size(); }
+   void clear();
+   void print (outbuf& outfile) const;
+   // Same output as astree::print on the original tree.
+};
+
+#endif
+
@@ -0,0 +1,964 @@
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ir.h"
+#include "lyutils.h"
+
+bool ir_function::enabled = true;
+
+const char* const vreg_prefix[VREG_KINDS] = {"i", "p", "a"};
+const char* const vreg_type[VREG_KINDS] = {"int", "char*", "void*"};
+
+static const char* const opcode_names[ir_instr::OPCODES] = {
+   "copy", "add", "sub", "mul", "div", "rem", "lt", "le", "gt", "ge",
+   "eq", "ne", "neg", "not", "load_field", "store_field", "load_index",
+   "store_index", "call", "phi", "jump", "branch", "return",
+};
+static const char* const operators[ir_instr::OPCODES] = {
+   "", "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=",
+   "-", "!",
+};
+static const uint32_t no_block = ir_function::no_block;
+
+vreg_kind vreg_kind_of (const bitset<ATTR_bitset_size>& attributes) {
+   if (attributes[ATTR_array]) return VREG_ADDRESS;
+   if (attributes[ATTR_int]) return VREG_INT;
+   if (attributes[ATTR_string]) return VREG_POINTER;
+   return VREG_ADDRESS;
+}
+
+static ir_instr make_instr (ir_instr::opcode op, ir_value dest,
+                            ir_value a = ir_value::none(),
+                            ir_value b = ir_value::none(),
+                            ir_value c = ir_value::none()) {
+   ir_instr instr;
+   instr.op = op;
+   instr.type = VREG_INT;
+   instr.ctype = 0;
+   instr.dest = dest;
+   instr.a = a;
+   instr.b = b;
+   instr.c = c;
+   instr.aux[0] = instr.aux[1] = 0;
+   instr.layout = nullptr;
+   return instr;
+}
+
+void ir_function::clear() {
+   for (size_t nr = 1; nr < blocks.size(); ++nr) {
+      blocks[nr].code.clear();
+      spare_code.push_back (move (blocks[nr].code));
+   }
+   blocks.resize (1);
+   blocks[0].code.clear();
+   blocks[0].label = nullptr;
+   blocks[0].lloc = {0, 0, 0};
+   vars.clear();
+   texts.clear();
+   types.assign (1, vreg_type[VREG_ADDRESS]);
+   args.clear();
+   var_names.clear();
+   vregs = 0;
+   removed = {0, 0, 0, 0, 0, 0, 0};
+}
+
+uint32_t ir_function::find_var (const interned* name,
+                                const location& decl) {
+   auto& candidates = var_names[name];
+   for (uint32_t nr: candidates) {
+      const location& loc = vars[nr].decl;
+      if (loc.filenr == decl.filenr and loc.linenr == decl.linenr
+          and loc.offset == decl.offset) return nr;
+   }
+   // Not declared in this function, so a global.
+   candidates.push_back (vars.size());
+   vars.push_back ({name, decl, 0, "", VREG_INT, 0, false, false});
+   return vars.size() - 1;
+}
+
+// type is the type node of a declaration, with the declared name
+// under it.  Declarations in block 0 are the globals.
+uint32_t ir_function::add_var (astree* type, bool param) {
+   bool array = type->symbol == TOK_ARRAY;
+   astree* base = array ? type->children[0] : type;
+   astree* name = array ? type->children[1] : type->children[0];
+   string ctype;
+   vreg_kind kind = VREG_ADDRESS;
+   switch (base->symbol) {
+      case TOK_INT:    ctype = "int"; kind = VREG_INT; break;
+      case TOK_STRING: ctype = "char*"; kind = VREG_POINTER; break;
+      default:         ctype = "struct s_" + base->lexinfo->str() + "*";
+   }
+   if (array) {
+      ctype += "*";
+      kind = VREG_ADDRESS;
+   }
+   uint16_t type_nr = kind == VREG_ADDRESS ? add_type (ctype) : 0;
+   var_names[name->lexinfo].push_back (vars.size());
+   vars.push_back ({name->lexinfo, type->lloc, type->block_nr,
+                    move (ctype), kind, type_nr, type->block_nr != 0,
+                    param});
+   return vars.size() - 1;
+}
+
+uint32_t ir_function::add_text (const interned* text) {
+   texts.push_back (text);
+   return texts.size() - 1;
+}
+
+// A function uses only a few struct types, so they are searched.
+uint16_t ir_function::add_type (const string& type) {
+   for (size_t nr = 0; nr < types.size(); ++nr) {
+      if (types[nr] == type) return nr;
+   }
+   types.push_back (type);
+   return types.size() - 1;
+}
+
+void ir_function::lower_params (astree* paramlist) {
+   for (astree* param: paramlist->children) add_var (param, true);
+}
+
+//
+// Lowering keeps the pending nodes on an explicit stack, as
+// func_codegen does, so that nesting depth is bounded by memory.
+// step counts the children handed out so far and vals keeps the
+// values of the ones that are read.
+//
+
+namespace {
+struct lower_frame {
+   astree* node;
+   uint32_t step;
+   uint32_t nvals;
+   ir_value vals[3];
+   uint32_t patch[2];   // blocks whose terminators need a target
+   vector<ir_value> call_args;
+};
+}
+
+struct ir_lowering {
+   ir_function& fn;
+   uint32_t current;
+
+   explicit ir_lowering (ir_function& fn_):
+      fn (fn_), current (fn_.blocks.size() - 1) {}
+
+   ir_block& block() { return fn.blocks[current]; }
+   bool terminated() {
+      return not block().code.empty()
+             and block().code.back().is_terminator();
+   }
+   // Code after a return or a jump is unreachable, but is kept for
+   // now, in a block of its own.  The block is only started when such
+   // code turns up, so a function that ends in a return has no empty
+   // block after it.
+   void append (const ir_instr& instr) {
+      if (terminated()) new_block (nullptr, block().lloc);
+      block().code.push_back (instr);
+   }
+   ir_value new_vreg (astree* node, ir_instr& instr) {
+      instr.type = vreg_kind_of (node->attributes);
+      if (instr.type == VREG_ADDRESS) {
+         instr.ctype = fn.add_type (make_oil_type (node));
+      }
+      instr.dest = ir_value::vreg (++fn.vregs);
+      return instr.dest;
+   }
+   // Starts a block after the current one, which falls into it
+   // unless it already ends in a jump.
+   uint32_t start_block (const char* label, const location& lloc) {
+      uint32_t next = fn.blocks.size();
+      if (not terminated()) {
+         ir_instr jump = make_instr (ir_instr::JUMP, ir_value::none());
+         jump.aux[0] = next;
+         append (jump);
+      }
+      new_block (label, lloc);
+      return next;
+   }
+   void new_block (const char* label, const location& lloc) {
+      fn.blocks.push_back ({{}, label, lloc});
+      if (not fn.spare_code.empty()) {
+         fn.blocks.back().code = move (fn.spare_code.back());
+         fn.spare_code.pop_back();
+      }
+      current = fn.blocks.size() - 1;
+   }
+   void jump (uint32_t target) {
+      ir_instr instr = make_instr (ir_instr::JUMP, ir_value::none());
+      instr.aux[0] = target;
+      append (instr);
+   }
+   // Arithmetic and comparisons always give an int, whatever the
+   // type checker left on the node.
+   ir_value arithmetic (ir_instr& instr) {
+      instr.type = VREG_INT;
+      instr.dest = ir_value::vreg (++fn.vregs);
+      append (instr);
+      return instr.dest;
+   }
+   ir_value binary (astree* node, ir_instr::opcode op,
+                    const lower_frame& f) {
+      ir_instr instr = make_instr (op, ir_value::none(), f.vals[0],
+                                   f.vals[1]);
+      if (op != ir_instr::LOAD_INDEX) return arithmetic (instr);
+      ir_value result = new_vreg (node, instr);
+      append (instr);
+      return result;
+   }
+   astree* step (lower_frame& f, ir_value& result);
+};
+
+// Carries on lowering f.node.  Returns the next child to lower before
+// coming back here, or nullptr once the node is done and its value is
+// in result.
+astree* ir_lowering::step (lower_frame& f, ir_value& result) {
+   astree* node = f.node;
+   result = ir_value::none();
+   switch (node->symbol) {
+      case TOK_BLOCK:
+         if (f.step < node->children.size()) {
+            return node->children[f.step++];
+         }
+         return nullptr;
+      case TOK_RETURN:
+      case TOK_RETURNVOID: {
+         if (node->symbol == TOK_RETURN and f.step == 0) {
+            return node->children[f.step++];
+         }
+         append (make_instr (ir_instr::RETURN, ir_value::none(),
+                             f.nvals ? f.vals[0] : ir_value::none()));
+         return nullptr;
+      }
+      case '+': case '-': case '*': case '/': case '%':
+      case TOK_LT: case TOK_LE: case TOK_GT: case TOK_GE:
+      case TOK_EQ: case TOK_NE: {
+         if (f.step < 2) return node->children[f.step++];
+         ir_instr::opcode op;
+         switch (node->symbol) {
+            case '+':    op = ir_instr::ADD; break;
+            case '-':    op = ir_instr::SUB; break;
+            case '*':    op = ir_instr::MUL; break;
+            case '/':    op = ir_instr::DIV; break;
+            case '%':    op = ir_instr::REM; break;
+            case TOK_LT: op = ir_instr::LT; break;
+            case TOK_LE: op = ir_instr::LE; break;
+            case TOK_GT: op = ir_instr::GT; break;
+            case TOK_GE: op = ir_instr::GE; break;
+            case TOK_EQ: op = ir_instr::EQ; break;
+            default:     op = ir_instr::NE; break;
+         }
+         result = binary (node, op, f);
+         return nullptr;
+      }
+      case '!':
+      case TOK_NEG: {
+         if (f.step == 0) return node->children[f.step++];
+         ir_instr instr = make_instr (node->symbol == '!'
+                                      ? ir_instr::NOT : ir_instr::NEG,
+                                      ir_value::none(), f.vals[0]);
+         result = arithmetic (instr);
+         return nullptr;
+      }
+      case TOK_POS:
+         if (f.step == 0) return node->children[f.step++];
+         result = f.vals[0];
+         return nullptr;
+      case TOK_WHILE: {
+         if (f.step == 0) {
+            f.patch[0] = start_block ("while", node->lloc);
+            return node->children[f.step++];
+         }
+         if (f.step == 1) {
+            ir_instr branch = make_instr (ir_instr::BRANCH,
+                                          ir_value::none(), f.vals[0]);
+            branch.aux[0] = fn.blocks.size();
+            append (branch);
+            f.patch[1] = current;
+            start_block (nullptr, node->lloc);
+            return node->children[f.step++];
+         }
+         if (not terminated()) jump (f.patch[0]);
+         uint32_t exit = start_block ("break", node->lloc);
+         fn.blocks[f.patch[1]].code.back().aux[1] = exit;
+         return nullptr;
+      }
+      case TOK_IF:
+      case TOK_IFELSE: {
+         if (f.step == 0) return node->children[f.step++];
+         if (f.step == 1) {
+            ir_instr branch = make_instr (ir_instr::BRANCH,
+                                          ir_value::none(), f.vals[0]);
+            branch.aux[0] = fn.blocks.size();
+            append (branch);
+            f.patch[0] = current;
+            start_block (nullptr, node->lloc);
+            return node->children[f.step++];
+         }
+         if (node->symbol == TOK_IFELSE and f.step == 2) {
+            f.patch[1] = no_block;
+            if (not terminated()) {
+               jump (no_block);
+               f.patch[1] = current;
+            }
+            // The then part may have ended in a return, so the else
+            // block is started without falling into it.
+            new_block ("else", node->lloc);
+            fn.blocks[f.patch[0]].code.back().aux[1] = current;
+            return node->children[f.step++];
+         }
+         uint32_t fi = start_block ("fi", node->lloc);
+         if (node->symbol == TOK_IF) {
+            fn.blocks[f.patch[0]].code.back().aux[1] = fi;
+         }else if (f.patch[1] != no_block) {
+            fn.blocks[f.patch[1]].code.back().aux[0] = fi;
+         }
+         return nullptr;
+      }
+      case TOK_CALL: {
+         if (f.step == 0) f.step = 1;
+         if (f.step < node->children.size()) {
+            return node->children[f.step++];
+         }
+         ir_instr call = make_instr (ir_instr::CALL, ir_value::none());
+         call.aux[0] = fn.args.size();
+         call.aux[1] = f.call_args.size();
+         call.callee = node->children[0]->lexinfo;
+         fn.args.insert (fn.args.end(), f.call_args.begin(),
+                         f.call_args.end());
+         if (node->attributes[ATTR_int] or node->attributes[ATTR_string]
+             or node->attributes[ATTR_typeid]
+             or node->attributes[ATTR_array]) {
+            result = new_vreg (node, call);
+         }
+         append (call);
+         return nullptr;
+      }
+      case '=': {
+         astree* target = node->children[0];
+         if (target->symbol == TOK_IDENT) {
+            if (f.step == 0) return node->children[++f.step];
+            uint32_t var = fn.find_var (target->lexinfo, target->ref_loc);
+            append (make_instr (ir_instr::COPY, ir_value::var (var),
+                                f.vals[0]));
+            result = f.vals[0];
+            return nullptr;
+         }
+         if (target->symbol == '.' and target->ref != nullptr) {
+            if (f.step == 0) {
+               ++f.step;
+               return target->children[0];
+            }
+            if (f.step == 1) return node->children[f.step++];
+            ir_instr store = make_instr (ir_instr::STORE_FIELD,
+                  ir_value::none(), f.vals[0], f.vals[1]);
+            store.layout = target->ref;
+            store.aux[0] = target->field_nr;
+            append (store);
+            result = f.vals[1];
+            return nullptr;
+         }
+         if (target->symbol == TOK_INDEX) {
+            if (f.step < 2) return target->children[f.step++];
+            if (f.step == 2) return node->children[f.step++ - 1];
+            append (make_instr (ir_instr::STORE_INDEX, ir_value::none(),
+                                f.vals[0], f.vals[1], f.vals[2]));
+            result = f.vals[2];
+            return nullptr;
+         }
+         // Not something that can be assigned, which semantic
+         // analysis has reported.
+         if (f.step < 2) return node->children[f.step++];
+         result = f.vals[1];
+         return nullptr;
+      }
+      case TOK_VARDECL: {
+         if (f.step == 0) return node->children[++f.step];
+         uint32_t var = fn.add_var (node->children[0], false);
+         append (make_instr (ir_instr::COPY, ir_value::var (var),
+                             f.vals[0]));
+         result = ir_value::var (var);
+         return nullptr;
+      }
+      case TOK_INDEX: {
+         if (f.step < 2) return node->children[f.step++];
+         result = binary (node, ir_instr::LOAD_INDEX, f);
+         return nullptr;
+      }
+      case '.': {
+         if (f.step == 0) return node->children[f.step++];
+         if (node->ref == nullptr) {
+            result = f.vals[0];
+            return nullptr;
+         }
+         ir_instr load = make_instr (ir_instr::LOAD_FIELD,
+                                     ir_value::none(), f.vals[0]);
+         load.layout = node->ref;
+         load.aux[0] = node->field_nr;
+         result = new_vreg (node, load);
+         append (load);
+         return nullptr;
+      }
+      case TOK_IDENT:
+         result = ir_value::var (fn.find_var (node->lexinfo,
+                                              node->ref_loc));
+         return nullptr;
+      case TOK_INTCON: {
+         // As in folding, a literal with a leading zero, which C reads
+         // as octal, or one too big for an int is kept as written.
+         const interned& text = *node->lexinfo;
+         char* end;
+         long long number = strtoll (text.c_str(), &end, 10);
+         if ((text.size() > 1 and text[0] == '0') or *end != '\0'
+             or number > INT32_MAX) {
+            result = ir_value::text (fn.add_text (node->lexinfo));
+         }else {
+            result = ir_value::constant (number);
+         }
+         return nullptr;
+      }
+      case TOK_NULL:
+         result = ir_value::constant (0);
+         return nullptr;
+   }
+   // Anything else is passed on as its text, as func_codegen does.
+   result = ir_value::text (fn.add_text (node->lexinfo));
+   return nullptr;
+}
+
+void ir_function::lower (astree* node) {
+   if (blocks.empty()) clear();
+   ir_lowering low (*this);
+   static thread_local vector<lower_frame> frames;
+   ir_value result;
+   frames.push_back ({node, 0, 0, {}, {}, {}});
+   while (true) {
+      astree* child = low.step (frames.back(), result);
+      if (child != nullptr) {
+         frames.push_back ({child, 0, 0, {}, {}, {}});
+         continue;
+      }
+      frames.pop_back();
+      if (frames.empty()) return;
+      lower_frame& parent = frames.back();
+      // Statements are not read by anything.
+      if (parent.node->symbol == TOK_BLOCK) continue;
+      if (parent.node->symbol == TOK_CALL) {
+         parent.call_args.push_back (result);
+      }else if (parent.nvals < 3) {
+         parent.vals[parent.nvals++] = result;
+      }
+   }
+}
+
+//
+// Emission.  Each vreg lives from the instruction that sets it to
+// its last use, stretched over whole blocks where liveness says it
+// is live on entry or exit; only vregs used outside the block that
+// sets them need the dataflow.  The live ranges are then given C
+// locals by linear scan, one pool per C type.
+//
+
+namespace {
+struct emitter {
+   const ir_function& fn;
+   outbuf& out;
+   // Kept from one function to the next for the memory.
+   static thread_local vector<uint32_t> local;  // C local of each vreg
+   static thread_local vector<vreg_kind> kind;
+   // The pool of the local: the kind, or past VREG_ADDRESS, the
+   // C type of an a vreg.
+   static thread_local vector<uint32_t> pool;
+   static thread_local vector<bool> referenced; // blocks a goto names
+
+   emitter (const ir_function& fn_, outbuf& out_):
+      fn (fn_), out (out_) {
+      local.assign (fn.vregs + 1, 0);
+      kind.assign (fn.vregs + 1, VREG_INT);
+      pool.assign (fn.vregs + 1, VREG_INT);
+      referenced.assign (fn.blocks.size(), false);
+   }
+
+   void put_var (const ir_var& var) {
+      if (var.local) {
+         out.put ('_');
+         out.put_int (var.block_nr);
+         out.put ('_');
+      }else {
+         out.put ("__");
+      }
+      out.put (*var.name);
+   }
+   void put_value (const ir_value& value) {
+      switch (value.what) {
+         case ir_value::NONE:
+            break;
+         case ir_value::VREG:
+            out.put (vreg_prefix[kind[value.index]]);
+            out.put_int (local[value.index]);
+            break;
+         case ir_value::CONST:
+            if (value.number == INT_MIN) out.put ("(-2147483647-1)");
+            else out.put_int (value.number);
+            break;
+         case ir_value::VAR:
+            put_var (fn.vars[value.index]);
+            break;
+         case ir_value::TEXT:
+            out.put (*fn.texts[value.index]);
+            break;
+      }
+   }
+   void put_label (uint32_t nr) {
+      const ir_block& block = fn.blocks[nr];
+      if (block.label == nullptr) {
+         out.put ("block_");
+         out.put_int (nr);
+         return;
+      }
+      out.printf ("%s_%lu_%lu_%lu", block.label, block.lloc.filenr,
+                  block.lloc.linenr, block.lloc.offset);
+   }
+   void put_goto (uint32_t nr) {
+      out.put ("goto ");
+      put_label (nr);
+      out.put (";\n");
+   }
+   void put_field (const ir_instr& instr) {
+      out.put ("->f_");
+      out.put (*instr.layout->name);
+      out.put ('_');
+      out.put (*instr.layout->fields[instr.aux[0]].name);
+   }
+   void mark_gotos();
+   size_t allocate();
+   void put_instr (const ir_instr& instr, uint32_t next);
+};
+}
+
+thread_local vector<uint32_t> emitter::local;
+thread_local vector<vreg_kind> emitter::kind;
+thread_local vector<uint32_t> emitter::pool;
+thread_local vector<bool> emitter::referenced;
+
+// Marks the blocks a goto will be written for, the same way put_instr
+// decides, so that only those get labels.
+void emitter::mark_gotos() {
+   for (uint32_t nr = 0; nr < fn.blocks.size(); ++nr) {
+      const vector<ir_instr>& code = fn.blocks[nr].code;
+      if (code.empty()) continue;
+      const ir_instr& last = code.back();
+      if (last.op == ir_instr::JUMP) {
+         if (last.aux[0] != nr + 1) referenced[last.aux[0]] = true;
+      }else if (last.op == ir_instr::BRANCH) {
+         if (last.aux[0] != nr + 1) referenced[last.aux[0]] = true;
+         if (last.aux[1] != nr + 1 or last.aux[0] == nr + 1) {
+            referenced[last.aux[1]] = true;
+         }
+      }
+   }
+}
+
+int ir_function::successors (uint32_t nr, uint32_t next[2]) const {
+   const vector<ir_instr>& code = blocks[nr].code;
+   if (code.empty() or not code.back().is_terminator()) {
+      if (nr + 1 >= blocks.size()) return 0;
+      next[0] = nr + 1;
+      return 1;
+   }
+   const ir_instr& last = code.back();
+   if (last.op == ir_instr::JUMP) {
+      next[0] = last.aux[0];
+      return 1;
+   }
+   if (last.op == ir_instr::BRANCH) {
+      next[0] = last.aux[0];
+      next[1] = last.aux[1];
+      return 2;
+   }
+   return 0;
+}
+
+// Gives every vreg a C local.  Returns how many locals there are.
+size_t emitter::allocate() {
+   uint32_t vregs = fn.vregs + 1;
+   uint32_t blocks = fn.blocks.size();
+   static thread_local vector<uint32_t> start, end, def_block, dense;
+   static thread_local vector<uint32_t> crossing, first, last, order;
+   static thread_local vector<bool> var_used;
+   start.assign (vregs, UINT32_MAX);
+   end.assign (vregs, 0);
+   def_block.assign (vregs, no_block);
+   dense.assign (vregs, no_block);
+   var_used.assign (fn.vars.size(), false);
+   crossing.clear();
+   first.resize (blocks);
+   last.resize (blocks);
+   // Out of SSA, the copies that replaced a phi set its vreg in
+   // several blocks.  Such a vreg is live across blocks wherever it
+   // is used.
+   const uint32_t many_blocks = no_block - 1;
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      for (const ir_instr& instr: fn.blocks[nr].code) {
+         if (instr.dest.what == ir_value::VAR) {
+            var_used[instr.dest.index] = true;
+         }
+         if (instr.dest.what != ir_value::VREG) continue;
+         uint32_t& block = def_block[instr.dest.index];
+         block = block == no_block or block == nr ? nr : many_blocks;
+      }
+   }
+   uint32_t position = 0;
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      first[nr] = position;
+      for (const ir_instr& instr: fn.blocks[nr].code) {
+         for_each_use (fn, instr, [&] (const ir_value& value) {
+            if (value.what == ir_value::VAR) var_used[value.index] = true;
+            if (value.what != ir_value::VREG) return;
+            uint32_t vreg = value.index;
+            end[vreg] = max (end[vreg], position);
+            if (def_block[vreg] != nr and dense[vreg] == no_block) {
+               dense[vreg] = crossing.size();
+               crossing.push_back (vreg);
+            }
+         });
+         if (instr.dest.what == ir_value::VREG) {
+            uint32_t vreg = instr.dest.index;
+            start[vreg] = min (start[vreg], position);
+            end[vreg] = max (end[vreg], position);
+            kind[vreg] = instr.type;
+            pool[vreg] = instr.type == VREG_ADDRESS
+                         ? VREG_ADDRESS + instr.ctype : instr.type;
+         }
+         ++position;
+      }
+      last[nr] = position == first[nr] ? position : position - 1;
+   }
+
+   if (not crossing.empty()) {
+      size_t words = (crossing.size() + 63) / 64;
+      static thread_local vector<uint64_t> uses, defs, live_in, live_out;
+      uses.assign (blocks * words, 0);
+      defs.assign (blocks * words, 0);
+      live_in.assign (blocks * words, 0);
+      live_out.assign (blocks * words, 0);
+      for (uint32_t nr = 0; nr < blocks; ++nr) {
+         uint64_t* use = &uses[nr * words];
+         uint64_t* def = &defs[nr * words];
+         for (const ir_instr& instr: fn.blocks[nr].code) {
+            for_each_use (fn, instr, [&] (const ir_value& value) {
+               if (value.what != ir_value::VREG) return;
+               uint32_t bit = dense[value.index];
+               if (bit == no_block) return;
+               if (not (def[bit / 64] >> (bit % 64) & 1)) {
+                  use[bit / 64] |= uint64_t (1) << (bit % 64);
+               }
+            });
+            if (instr.dest.what == ir_value::VREG) {
+               uint32_t bit = dense[instr.dest.index];
+               if (bit != no_block) {
+                  def[bit / 64] |= uint64_t (1) << (bit % 64);
+               }
+            }
+         }
+      }
+      for (bool changed = true; changed;) {
+         changed = false;
+         for (uint32_t nr = blocks; nr-- > 0;) {
+            uint32_t next[2];
+            int count = fn.successors (nr, next);
+            for (size_t word = 0; word < words; ++word) {
+               uint64_t out = 0;
+               for (int succ = 0; succ < count; ++succ) {
+                  out |= live_in[next[succ] * words + word];
+               }
+               uint64_t in = uses[nr * words + word]
+                           | (out & ~defs[nr * words + word]);
+               if (in != live_in[nr * words + word]) changed = true;
+               live_out[nr * words + word] = out;
+               live_in[nr * words + word] = in;
+            }
+         }
+      }
+      for (uint32_t nr = 0; nr < blocks; ++nr) {
+         for (uint32_t bit = 0; bit < crossing.size(); ++bit) {
+            uint32_t vreg = crossing[bit];
+            if (live_in[nr * words + bit / 64] >> (bit % 64) & 1) {
+               start[vreg] = min (start[vreg], first[nr]);
+            }
+            if (live_out[nr * words + bit / 64] >> (bit % 64) & 1) {
+               end[vreg] = max (end[vreg], last[nr]);
+            }
+         }
+      }
+   }
+
+   order.clear();
+   for (uint32_t vreg = 1; vreg < vregs; ++vreg) {
+      if (start[vreg] != UINT32_MAX) order.push_back (vreg);
+   }
+   sort (order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+      return start[a] < start[b];
+   });
+   // Heaps of the live ranges that hold a local, soonest end first.
+   using range = pair<uint32_t, uint32_t>;  // end, local
+   static thread_local vector<vector<range>> active;
+   static thread_local vector<vector<uint32_t>> spare, declared;
+   size_t pools = VREG_ADDRESS + fn.types.size();
+   if (active.size() < pools) {
+      active.resize (pools);
+      spare.resize (pools);
+      declared.resize (pools);
+   }
+   for (size_t k = 0; k < pools; ++k) {
+      active[k].clear();
+      spare[k].clear();
+      declared[k].clear();
+   }
+   uint32_t locals = 0;
+   for (uint32_t vreg: order) {
+      uint32_t k = pool[vreg];
+      // A local read by the instruction that sets vreg is free for it.
+      while (not active[k].empty()
+             and active[k].front().first <= start[vreg]) {
+         spare[k].push_back (active[k].front().second);
+         pop_heap (active[k].begin(), active[k].end(), greater<range>());
+         active[k].pop_back();
+      }
+      if (spare[k].empty()) {
+         local[vreg] = ++locals;
+         declared[k].push_back (locals);
+      }else {
+         local[vreg] = spare[k].back();
+         spare[k].pop_back();
+      }
+      active[k].push_back ({end[vreg], local[vreg]});
+      push_heap (active[k].begin(), active[k].end(), greater<range>());
+   }
+
+   for (uint32_t nr = 0; nr < fn.vars.size(); ++nr) {
+      const ir_var& var = fn.vars[nr];
+      if (not var.local or var.param or not var_used[nr]) continue;
+      out.printf ("        %s ", var.type.c_str());
+      put_var (var);
+      out.put (";\n");
+   }
+   for (size_t k = 0; k < pools; ++k) {
+      const char* type = k < VREG_ADDRESS ? vreg_type[k]
+                       : fn.types[k - VREG_ADDRESS].c_str();
+      const char* prefix = vreg_prefix[min<size_t> (k, VREG_ADDRESS)];
+      for (uint32_t nr: declared[k]) {
+         out.printf ("        %s %s%u;\n", type, prefix, nr);
+      }
+   }
+   return locals;
+}
+
+void emitter::put_instr (const ir_instr& instr, uint32_t next) {
+   switch (instr.op) {
+      case ir_instr::JUMP:
+         if (instr.aux[0] != next) put_goto (instr.aux[0]);
+         return;
+      case ir_instr::BRANCH:
+         out.put ("if(");
+         if (instr.aux[0] == next) {
+            out.put ('!');
+            put_value (instr.a);
+            out.put (") ");
+            put_goto (instr.aux[1]);
+            return;
+         }
+         if (instr.aux[1] == next) {
+            put_value (instr.a);
+            out.put (") ");
+            put_goto (instr.aux[0]);
+            return;
+         }
+         out.put ('!');
+         put_value (instr.a);
+         out.put (") ");
+         put_goto (instr.aux[1]);
+         put_goto (instr.aux[0]);
+         return;
+      case ir_instr::RETURN:
+         out.put ("return");
+         if (instr.a.what != ir_value::NONE) out.put (' ');
+         put_value (instr.a);
+         out.put (";\n");
+         return;
+      case ir_instr::COPY:
+         // Left by taking a phi out of SSA when both sides got the
+         // same local.
+         if (instr.dest.what == ir_value::VREG
+             and instr.a.what == ir_value::VREG
+             and kind[instr.dest.index] == kind[instr.a.index]
+             and local[instr.dest.index] == local[instr.a.index]) return;
+         break;
+      default:
+         break;
+   }
+   out.put ("        ");
+   if (instr.dest.what != ir_value::NONE) {
+      put_value (instr.dest);
+      out.put (" = ");
+   }
+   switch (instr.op) {
+      case ir_instr::COPY:
+         put_value (instr.a);
+         break;
+      case ir_instr::NEG:
+      case ir_instr::NOT:
+         out.put (operators[instr.op]);
+         put_value (instr.a);
+         break;
+      case ir_instr::LOAD_FIELD:
+         put_value (instr.a);
+         put_field (instr);
+         break;
+      case ir_instr::STORE_FIELD:
+         put_value (instr.a);
+         put_field (instr);
+         out.put (" = ");
+         put_value (instr.b);
+         break;
+      case ir_instr::LOAD_INDEX:
+         put_value (instr.a);
+         out.put ('[');
+         put_value (instr.b);
+         out.put (']');
+         break;
+      case ir_instr::STORE_INDEX:
+         put_value (instr.a);
+         out.put ('[');
+         put_value (instr.b);
+         out.put ("] = ");
+         put_value (instr.c);
+         break;
+      case ir_instr::CALL:
+         out.put ("__");
+         out.put (*instr.callee);
+         out.put ('(');
+         for (uint32_t arg = 0; arg < instr.aux[1]; ++arg) {
+            if (arg > 0) out.put (", ");
+            put_value (fn.args[instr.aux[0] + arg]);
+         }
+         out.put (')');
+         break;
+      default:
+         put_value (instr.a);
+         out.put (' ');
+         out.put (operators[instr.op]);
+         out.put (' ');
+         put_value (instr.b);
+   }
+   out.put (";\n");
+}
+
+size_t ir_function::emit (outbuf& out) const {
+   emitter emit (*this, out);
+   emit.mark_gotos();
+   size_t locals = emit.allocate();
+   for (uint32_t nr = 0; nr < blocks.size(); ++nr) {
+      if (emit.referenced[nr]) {
+         emit.put_label (nr);
+         out.put (":;\n");
+      }
+      for (const ir_instr& instr: blocks[nr].code) {
+         emit.put_instr (instr, nr + 1);
+      }
+   }
+   return locals;
+}
+
+static void dump_value (outbuf& out, const ir_function& fn,
+                        const ir_value& value) {
+   switch (value.what) {
+      case ir_value::NONE:
+         out.put ('_');
+         break;
+      case ir_value::VREG:
+         out.put ('v');
+         out.put_int (value.index);
+         break;
+      case ir_value::CONST:
+         out.put_int (value.number);
+         break;
+      case ir_value::VAR: {
+         const ir_var& var = fn.vars[value.index];
+         if (var.local) out.printf ("_%zu_", var.block_nr);
+         else out.put ("__");
+         out.put (*var.name);
+         break;
+      }
+      case ir_value::TEXT:
+         out.put ('`');
+         out.put (*fn.texts[value.index]);
+         out.put ('`');
+         break;
+   }
+}
+
+void ir_function::dump (outbuf& out, const char* name) const {
+   out.printf ("%s: %u vregs, %zu blocks\n", name, vregs, blocks.size());
+   for (uint32_t nr = 0; nr < blocks.size(); ++nr) {
+      const ir_block& block = blocks[nr];
+      out.printf ("b%u", nr);
+      if (block.label != nullptr) {
+         out.printf (" %s %zu.%zu.%zu", block.label, block.lloc.filenr,
+                     block.lloc.linenr, block.lloc.offset);
+      }
+      out.put (":\n");
+      for (const ir_instr& instr: block.code) {
+         out.put ("   ");
+         if (instr.dest.what != ir_value::NONE) {
+            dump_value (out, *this, instr.dest);
+            if (instr.dest.what == ir_value::VREG) {
+               out.printf (":%s", instr.type == VREG_ADDRESS
+                           ? types[instr.ctype].c_str()
+                           : vreg_type[instr.type]);
+            }
+            out.put (" = ");
+         }
+         out.put (opcode_names[instr.op]);
+         switch (instr.op) {
+            case ir_instr::JUMP:
+               out.printf (" b%u", instr.aux[0]);
+               break;
+            case ir_instr::BRANCH:
+               out.put (' ');
+               dump_value (out, *this, instr.a);
+               out.printf (" b%u b%u", instr.aux[0], instr.aux[1]);
+               break;
+            case ir_instr::PHI:
+               for (uint32_t pair = 0; pair < instr.aux[1]; ++pair) {
+                  out.put (pair ? ", " : " ");
+                  dump_value (out, *this, args[instr.aux[0] + 2 * pair]);
+                  out.printf (" b%d", args[instr.aux[0] + 2 * pair + 1].number);
+               }
+               break;
+            case ir_instr::CALL:
+               out.printf (" __%s", instr.callee->c_str());
+               for (uint32_t arg = 0; arg < instr.aux[1]; ++arg) {
+                  out.put (' ');
+                  dump_value (out, *this, args[instr.aux[0] + arg]);
+               }
+               break;
+            default:
+               for (const ir_value* operand: {&instr.a, &instr.b,
+                                              &instr.c}) {
+                  if (operand->what == ir_value::NONE) break;
+                  out.put (' ');
+                  dump_value (out, *this, *operand);
+               }
+               if (instr.op == ir_instr::LOAD_FIELD
+                   or instr.op == ir_instr::STORE_FIELD) {
+                  out.printf (" .%s.%s", instr.layout->name->c_str(),
+                        instr.layout->fields[instr.aux[0]].name->c_str());
+               }
+         }
+         out.put ('\n');
+      }
+   }
+}
@@ -0,0 +1,195 @@
+#ifndef __IR_H__
+#define __IR_H__
+
+#include <stdint.h>
+#include <bitset>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "astree.h"
+
+//
+// DESCRIPTION
+//    Three-address code for one function, built from its astree and
+//    turned into the C of the .oil file.  Instructions are fixed-size
+//    records kept in an array per basic block, and every block ends
+//    in an explicit jump, branch or return, so passes can work on the
+//    control flow instead of on label text.  Vregs are numbered from
+//    1.  optimize() works on SSA form, where local variables become
+//    vregs and each vreg is set by exactly one instruction, and leaves
+//    it by turning phis into copies.  The emitter gives vregs C locals
+//    by liveness, so vregs that are never live at the same time share
+//    a local.
+//
+
+enum vreg_kind : uint8_t { VREG_INT, VREG_POINTER, VREG_ADDRESS,
+                           VREG_KINDS };
+extern const char* const vreg_prefix[VREG_KINDS];
+extern const char* const vreg_type[VREG_KINDS];
+vreg_kind vreg_kind_of (const bitset<ATTR_bitset_size>& attributes);
+// int values go in i vregs, strings in p and anything else, structs
+// and arrays, in a vregs.  An a vreg also has the C type of what it
+// points to, from ir_function::types.
+
+struct ir_value {
+   enum kind : uint8_t { NONE, VREG, CONST, VAR, TEXT };
+   kind what;
+   union {
+      uint32_t index;  // VREG number, or index into vars or texts
+      int32_t number;  // CONST
+   };
+   static ir_value none() { ir_value v; v.what = NONE; v.index = 0;
+                            return v; }
+   static ir_value vreg (uint32_t nr) { ir_value v; v.what = VREG;
+                                        v.index = nr; return v; }
+   static ir_value constant (int32_t value) {
+      ir_value v; v.what = CONST; v.number = value; return v;
+   }
+   static ir_value var (uint32_t nr) { ir_value v; v.what = VAR;
+                                       v.index = nr; return v; }
+   static ir_value text (uint32_t nr) { ir_value v; v.what = TEXT;
+                                        v.index = nr; return v; }
+   bool operator== (const ir_value& that) const {
+      return what == that.what and index == that.index;
+   }
+   bool operator!= (const ir_value& that) const {
+      return not (*this == that);
+   }
+};
+
+struct ir_instr {
+   enum opcode : uint8_t {
+      COPY,                               // dest = a
+      ADD, SUB, MUL, DIV, REM,            // dest = a op b
+      LT, LE, GT, GE, EQ, NE,
+      NEG, NOT,                           // dest = op a
+      LOAD_FIELD, STORE_FIELD,            // dest = a->f, a->f = b
+      LOAD_INDEX, STORE_INDEX,            // dest = a[b], a[b] = c
+      CALL,                               // dest = callee (args)
+      PHI,                                // dest = phi (args)
+      JUMP, BRANCH, RETURN,               // terminators
+      OPCODES
+   };
+   opcode op;
+   vreg_kind type;      // of dest when it is a vreg
+   uint16_t ctype;      // of an a dest, index into types
+   ir_value dest;       // a vreg, a variable or none
+   ir_value a, b, c;
+   uint32_t aux[2];     // JUMP: target.  BRANCH: targets if a is
+                        // true and false.  Field ops: field ordinal.
+                        // CALL: first argument in args and count.
+                        // PHI: the same, for pairs of the value and
+                        // the constant number of the block it comes
+                        // from.
+   union {
+      const struct_layout* layout;  // field ops
+      const interned* callee;         // CALL
+   };
+   bool is_terminator() const {
+      return op == JUMP or op == BRANCH or op == RETURN;
+   }
+};
+
+struct ir_block {
+   vector<ir_instr> code;
+   const char* label;   // while, break, fi or else, if made by one
+   location lloc;       // of the statement that made it
+};
+
+struct ir_var {
+   const interned* name;
+   location decl;       // tells apart variables of the same name
+   size_t block_nr;
+   string type;         // C type of a local
+   vreg_kind kind;
+   uint16_t ctype;      // of type, when kind is VREG_ADDRESS
+   bool local;
+   bool param;
+};
+
+struct ir_function {
+   static constexpr uint32_t no_block = UINT32_MAX;
+   static bool enabled;
+   // Set by default.  oc --no-ir generates straight from the astree
+   // instead, to compare the two.
+
+   vector<ir_block> blocks;
+   vector<ir_var> vars;
+   vector<const interned*> texts;
+   vector<string> types;      // C types of a vregs, void* first
+   vector<ir_value> args;
+   uint32_t vregs = 0;
+   struct {
+      uint32_t branches;        // on a constant, made jumps
+      uint32_t unreachable;     // blocks with code no path reaches
+      uint32_t unreachable_code;
+      uint32_t common;          // repeated in a block, reused
+      uint32_t hoisted;         // out of loops, into a preheader
+      uint32_t temps;           // pure instructions nothing reads
+      uint32_t blocks;          // empty or unreachable, deleted
+   } removed;
+   // What optimize() took out or moved, for -@d.
+
+   void clear();
+   // Empties the function but keeps the memory for the next one.
+
+   void lower_params (astree* paramlist);
+   void lower (astree* node);
+   // Appends the code for node and everything under it to the last
+   // block.  Parameters have to be lowered before the body, so that
+   // uses of them are not taken for globals.
+
+   void optimize();
+   // Puts the function in SSA form, finds its constants and
+   // unreachable code with sparse conditional constant propagation,
+   // reuses expressions a block computes twice, moves code that gives
+   // the same value on every trip of a loop out of it, removes the
+   // code that is dead, and takes it out of SSA again, ready to emit.
+
+   size_t emit (outbuf& out) const;
+   // Writes the declarations and statements that go between the
+   // braces of the C function.  Returns the number of C locals the
+   // vregs were given.
+
+   void dump (outbuf& out, const char* name) const;
+   // Writes the IR in a readable form, for -@i.
+
+   int successors (uint32_t block, uint32_t next[2]) const;
+   // Puts the blocks control can go to from block in next, in the
+   // order of a branch's targets, and returns how many there are.
+   // A block that does not end in a jump falls into the next one.
+
+   private:
+      friend struct ir_lowering;
+      unordered_map<const interned*, vector<uint32_t>> var_names;
+      vector<vector<ir_instr>> spare_code;
+      uint32_t find_var (const interned* name, const location& decl);
+      uint32_t add_var (astree* type, bool param);
+      uint32_t add_text (const interned* text);
+      uint16_t add_type (const string& type);
+};
+
+// Calls use (value) on every operand instr reads, call arguments and
+// phi inputs included.  With a non-const fn, use may change the value
+// in place.
+template <typename function_type, typename instr_type, typename visit>
+void for_each_use (function_type& fn, instr_type& instr, visit use) {
+   if (instr.op == ir_instr::PHI) {
+      for (uint32_t pair = 0; pair < instr.aux[1]; ++pair) {
+         use (fn.args[instr.aux[0] + 2 * pair]);
+      }
+      return;
+   }
+   use (instr.a);
+   use (instr.b);
+   use (instr.c);
+   if (instr.op == ir_instr::CALL) {
+      for (uint32_t arg = 0; arg < instr.aux[1]; ++arg) {
+         use (fn.args[instr.aux[0] + arg]);
+      }
+   }
+}
+
+#endif
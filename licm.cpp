@@ -0,0 +1,280 @@
+#include <algorithm>
+
+#include "ssa.h"
+
+//
+// DESCRIPTION
+//    Loop-invariant code motion.  A loop is found by its back edges,
+//    the jumps to a block from blocks it dominates, and code in it
+//    whose operands are all set outside the loop moves to a preheader,
+//    a block placed before the loop's header that only the way into
+//    the loop goes through.  Inner loops go first, so what leaves one
+//    can leave the loops around it in turn.  An instruction that reads
+//    memory or a global moves only if nothing in the loop can change
+//    what it reads, and one that can trap, a load or a division, only
+//    if it runs on every trip and the loop makes no call, so it cannot
+//    trap where it did not or before output it came after.
+//
+
+static const uint32_t no_block = ir_function::no_block;
+
+namespace {
+
+struct loop_effects {
+   bool calls;
+   bool index_stores;
+   vector<pair<const struct_layout*, uint32_t>> field_stores;
+   vector<uint32_t> globals;    // assigned in the loop
+   void clear() {
+      calls = index_stores = false;
+      field_stores.clear();
+      globals.clear();
+   }
+   void add (const ir_instr& instr) {
+      switch (instr.op) {
+         case ir_instr::CALL: calls = true; break;
+         case ir_instr::STORE_INDEX: index_stores = true; break;
+         case ir_instr::STORE_FIELD:
+            field_stores.push_back ({instr.layout, instr.aux[0]});
+            break;
+         case ir_instr::COPY:
+            if (instr.dest.what == ir_value::VAR) {
+               globals.push_back (instr.dest.index);
+            }
+            break;
+         default:
+            break;
+      }
+   }
+   bool assigns (uint32_t global) const {
+      return find (globals.begin(), globals.end(), global)
+             != globals.end();
+   }
+   bool stores (const struct_layout* layout, uint32_t field) const {
+      return find (field_stores.begin(), field_stores.end(),
+                   make_pair (layout, field)) != field_stores.end();
+   }
+};
+
+}
+
+// Whether instr may run once in the preheader instead of where it is,
+// given that its operands do not change in the loop.  sure says it
+// runs on every trip, so that it cannot run there when it would not
+// have run at all.
+static bool may_hoist (const ir_instr& instr, const loop_effects& loop,
+                       bool sure) {
+   if (instr.dest.what != ir_value::VREG) return false;
+   switch (instr.op) {
+      case ir_instr::COPY:
+      case ir_instr::ADD: case ir_instr::SUB: case ir_instr::MUL:
+      case ir_instr::LT: case ir_instr::LE: case ir_instr::GT:
+      case ir_instr::GE: case ir_instr::EQ: case ir_instr::NE:
+      case ir_instr::NEG: case ir_instr::NOT:
+         return true;
+      case ir_instr::DIV:
+      case ir_instr::REM:
+         return sure and not loop.calls;
+      case ir_instr::LOAD_FIELD:
+         return sure and not loop.calls
+            and not loop.stores (instr.layout, instr.aux[0]);
+      case ir_instr::LOAD_INDEX:
+         return sure and not loop.calls and not loop.index_stores;
+      default:
+         return false;
+   }
+}
+
+void hoist_invariants (ir_function& fn, const flow_graph& graph) {
+   // Headers in reverse postorder, so a loop's comes before those of
+   // the loops in it.
+   static thread_local vector<uint32_t> headers;
+   headers.clear();
+   for (uint32_t nr: graph.order) {
+      for (uint32_t pred = graph.pred_first[nr];
+           pred < graph.pred_first[nr + 1]; ++pred) {
+         if (graph.intersect (nr, graph.preds[pred]) == nr) {
+            headers.push_back (nr);
+            break;
+         }
+      }
+   }
+   if (headers.empty()) return;
+
+   uint32_t blocks = fn.blocks.size();
+   uint32_t most = blocks + headers.size();
+   // Preheaders are added as they are needed, and references into
+   // blocks have to stay good while they are.
+   fn.blocks.reserve (most);
+   static thread_local vector<uint32_t> def_block, member, sure;
+   static thread_local vector<uint32_t> preheader, before;
+   def_block.assign (fn.vregs + 1, no_block);
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      for (const ir_instr& instr: fn.blocks[nr].code) {
+         if (instr.dest.what == ir_value::VREG) {
+            def_block[instr.dest.index] = nr;
+         }
+      }
+   }
+   // For each block, the header of the last loop found to hold it, and
+   // of the last loop it runs on every trip of.
+   member.assign (most, no_block);
+   sure.assign (most, no_block);
+   preheader.assign (blocks, no_block);
+   before.clear();
+   static thread_local vector<uint32_t> body, work;
+   static thread_local loop_effects loop;
+
+   for (auto next = headers.rbegin(); next != headers.rend(); ++next) {
+      uint32_t header = *next;
+      body.assign (1, header);
+      member[header] = header;
+      work.clear();
+      uint32_t entry = no_block;
+      int entries = 0;
+      for (uint32_t pred = graph.pred_first[header];
+           pred < graph.pred_first[header + 1]; ++pred) {
+         uint32_t from = graph.preds[pred];
+         if (graph.intersect (header, from) != header) {
+            entry = from;
+            ++entries;
+         }else if (member[from] != header) {
+            member[from] = header;
+            body.push_back (from);
+            work.push_back (from);
+         }
+      }
+      while (not work.empty()) {
+         uint32_t nr = work.back();
+         work.pop_back();
+         for (uint32_t pred = graph.pred_first[nr];
+              pred < graph.pred_first[nr + 1]; ++pred) {
+            uint32_t from = graph.preds[pred];
+            if (member[from] == header) continue;
+            member[from] = header;
+            body.push_back (from);
+            work.push_back (from);
+         }
+      }
+      // A while loop is only ever entered from the block before it.
+      if (entries != 1) continue;
+
+      // Inner loops' preheaders are part of this loop.
+      size_t count = body.size();
+      for (size_t index = 0; index < count; ++index) {
+         uint32_t nr = body[index];
+         if (nr == header or preheader[nr] == no_block) continue;
+         member[preheader[nr]] = header;
+         body.push_back (preheader[nr]);
+      }
+
+      // The blocks that run on every trip are those that dominate
+      // each way out, and a preheader when its header does.
+      uint32_t always = no_block;
+      for (uint32_t nr: body) {
+         uint32_t succs[2];
+         int succ_count = fn.successors (nr, succs);
+         for (int succ = 0; succ < succ_count; ++succ) {
+            if (member[succs[succ]] == header) continue;
+            always = always == no_block ? nr
+                                        : graph.intersect (always, nr);
+         }
+      }
+      if (always == no_block) always = header;
+      for (uint32_t nr = always;; nr = graph.idom[nr]) {
+         sure[nr] = header;
+         if (nr == header) break;
+      }
+      for (size_t index = count; index < body.size(); ++index) {
+         uint32_t pre = body[index];
+         if (sure[before[pre - blocks]] == header) sure[pre] = header;
+      }
+
+      // Each preheader just before its header puts the body in an
+      // order where sets come before uses.
+      auto rank = [&] (uint32_t nr) {
+         return nr < blocks ? 2 * graph.rank[nr] + 1
+                            : 2 * graph.rank[before[nr - blocks]];
+      };
+      sort (body.begin(), body.end(),
+            [&] (uint32_t a, uint32_t b) { return rank (a) < rank (b); });
+
+      loop.clear();
+      for (uint32_t nr: body) {
+         for (const ir_instr& instr: fn.blocks[nr].code) loop.add (instr);
+      }
+      auto invariant = [&] (const ir_value& value) {
+         switch (value.what) {
+            case ir_value::VREG:
+               return def_block[value.index] == no_block
+                      or member[def_block[value.index]] != header;
+            case ir_value::VAR:
+               return not loop.calls and not loop.assigns (value.index);
+            case ir_value::TEXT:
+               // A string constant, but not new or the like.
+               return (*fn.texts[value.index])[0] == '"';
+            default:
+               return true;
+         }
+      };
+
+      uint32_t pre = preheader[header];
+      for (uint32_t nr: body) {
+         vector<ir_instr>& code = fn.blocks[nr].code;
+         size_t kept = 0;
+         for (size_t index = 0; index < code.size(); ++index) {
+            ir_instr& instr = code[index];
+            bool moves = may_hoist (instr, loop, sure[nr] == header);
+            if (moves) {
+               for_each_use (fn, instr, [&] (const ir_value& value) {
+                  if (not invariant (value)) moves = false;
+               });
+            }
+            if (not moves) {
+               if (kept != index) code[kept] = instr;
+               ++kept;
+               continue;
+            }
+            if (pre == no_block) {
+               pre = fn.blocks.size();
+               ir_instr jump = instr;
+               jump.op = ir_instr::JUMP;
+               jump.dest = jump.a = jump.b = jump.c = ir_value::none();
+               jump.aux[0] = header;
+               jump.aux[1] = 0;
+               jump.layout = nullptr;
+               fn.blocks.push_back ({{jump}, nullptr,
+                                     fn.blocks[header].lloc});
+               preheader[header] = pre;
+               before.push_back (header);
+               vector<ir_instr>& entry_code = fn.blocks[entry].code;
+               if (entry_code.empty()
+                   or not entry_code.back().is_terminator()) {
+                  jump.aux[0] = pre;
+                  entry_code.push_back (jump);
+               }else {
+                  ir_instr& last = entry_code.back();
+                  int targets = last.op == ir_instr::BRANCH ? 2
+                              : last.op == ir_instr::JUMP ? 1 : 0;
+                  for (int target = 0; target < targets; ++target) {
+                     if (last.aux[target] == header) last.aux[target] = pre;
+                  }
+               }
+               for (ir_instr& phi: fn.blocks[header].code) {
+                  if (phi.op != ir_instr::PHI) break;
+                  for (uint32_t input = 0; input < phi.aux[1]; ++input) {
+                     ir_value& from = fn.args[phi.aux[0] + 2 * input + 1];
+                     if (uint32_t (from.number) == entry) from.number = pre;
+                  }
+               }
+            }
+            vector<ir_instr>& pre_code = fn.blocks[pre].code;
+            pre_code.insert (pre_code.end() - 1, instr);
+            def_block[instr.dest.index] = pre;
+            ++fn.removed.hoisted;
+         }
+         code.resize (kept);
+      }
+   }
+   if (not before.empty()) place_blocks (fn, blocks, before);
+}
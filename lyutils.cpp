@@ -13,7 +13,7 @@ bool lexer::interactive = true;
 location lexer::lloc = {0, 1, 0};
 size_t lexer::last_yyleng = 0;
 vector<string> lexer::filenames;
-FILE* astree::tok_file = nullptr;
+outbuf astree::tok_file;
 astree* parser::root = nullptr;
 
 const string* lexer::filename (int filenr) {
@@ -67,7 +67,7 @@ void lexer::include() {
          fprintf (stderr, "--included # %zd \"%s\"\n",
                   linenr, filename);
       }
-      fprintf(astree::tok_file,"# %3zd \"%s\"\n",
+      astree::tok_file.printf("# %3zd \"%s\"\n",
                 linenr, filename);
       lexer::lloc.linenr = linenr - 1;
       lexer::newfilename (filename);
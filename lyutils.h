@@ -37,6 +37,9 @@ struct lexer {
    static void badchar (unsigned char bad);
    static void badtoken (char* lexeme);
    static void include();
+   static void scan_buffer (char* base, size_t len);
+   // Scans base[0..len) in place.  base[len] and base[len+1] must
+   // be NUL; flex writes into the buffer while scanning.
 };
 
 struct parser {
@@ -45,6 +48,8 @@ struct parser {
 };
 
 #define YYSTYPE astree*
+// A plain pointer, so bison may grow its stacks with memcpy.
+#define YYSTYPE_IS_TRIVIAL 1
 #include "yyparse.h"
 
 #endif
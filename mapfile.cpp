@@ -0,0 +1,52 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapfile.h"
+
+mapfile::~mapfile() {
+   close();
+}
+
+bool mapfile::open (const string& filename) {
+   close();
+   int fd = ::open (filename.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat info;
+   if (fstat (fd, &info) != 0) {
+      ::close (fd);
+      return false;
+   }
+   size_t page = sysconf (_SC_PAGESIZE);
+   size_t size = info.st_size;
+   size_t total = (size + 2 + page - 1) / page * page;
+   // Reserve zeroed memory for the file plus the two NULs, then put
+   // the file over the front of it.  The tail of the file's last page
+   // reads as zeros too.
+   void* region = mmap (nullptr, total, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (region == MAP_FAILED) {
+      ::close (fd);
+      return false;
+   }
+   if (size > 0 and mmap (region, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      munmap (region, total);
+      ::close (fd);
+      return false;
+   }
+   ::close (fd);
+   base = static_cast<char*> (region);
+   length = size;
+   mapped = total;
+   return true;
+}
+
+void mapfile::close() {
+   if (base == nullptr) return;
+   munmap (base, mapped);
+   base = nullptr;
+   length = mapped = 0;
+}
+
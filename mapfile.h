@@ -0,0 +1,35 @@
+#ifndef __MAPFILE_H__
+#define __MAPFILE_H__
+
+#include <stddef.h>
+#include <string>
+using namespace std;
+
+//
+// DESCRIPTION
+//    Private, writable memory mapping of a whole file followed by
+//    two NUL bytes, which is the layout flex's yy_scan_buffer needs
+//    to scan a buffer in place.  Writes never reach the file.
+//
+
+struct mapfile {
+   mapfile() {}
+   ~mapfile();
+   mapfile (const mapfile&) = delete;
+   mapfile& operator= (const mapfile&) = delete;
+
+   bool open (const string& filename);
+   // Returns false and sets errno on failure.
+
+   void close();
+   char* data() const { return base; }
+   size_t size() const { return length; }
+
+   private:
+      char* base = nullptr;
+      size_t length = 0;
+      size_t mapped = 0;
+};
+
+#endif
+
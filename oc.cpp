@@ -3,19 +3,29 @@
  * */
 #include <string>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wait.h>
+#include <errno.h>
 #include "auxlib.h"
 #include "string_set.h"
 #include "astree.h"
 #include "lyutils.h"
+#include "flat_tree.h"
+#include "preproc.h"
+#include "mapfile.h"
+#include "server.h"
+#include "cache.h"
+#include "stats.h"
+#include "ir.h"
 
 using namespace std;
-FILE* sym_file;
-FILE* oil_file;
+outbuf sym_file;
+outbuf oil_file;
 const string CPP = "cpp -nostdinc";
 constexpr size_t LINESIZE = 1024;
 
@@ -54,88 +64,513 @@ void cpplines(FILE* pipe, const char* filename){
 	}
 }
 
-int main(int argc, char** argv){
-	exec::execname = basename(argv[0]);
-	//Check for arguments, prints usage
-	if(argc == 1){
-		fprintf(stderr,"Usage: oc [-ly] [-@ flag...] [-D string]"
-			" program.oc\n");
-		return 1;
+//Counts the lines written to the oil file for --stats
+static void count_oil_lines(const string& oil_file_name){
+	mapfile oil;
+	if(!oil.open(oil_file_name)) return;
+	const char* end = oil.data() + oil.size();
+	size_t lines = 0;
+	for(const char* pos = oil.data();
+			(pos = (const char*) memchr(pos, '\n', end - pos)) != nullptr;
+			++pos){
+		++lines;
 	}
-	//Gets the file name check file extension and what not
-	string filename = basename(argv[argc-1]);
-	if(filename.substr(filename.find_last_of(".") + 1).compare("oc") != 0){
-		fprintf(stderr,"File extension does not match\n");
-		return 1;
-	}
-	int opt;
-	string command = CPP+ " ";
-	//Commented out both ints so that the compileri doesn't complain
-	yy_flex_debug = 0;
-	yydebug	      = 0;
-	//Gets the command line argments
-	while((opt = getopt(argc, argv, "ly@:D:")) != -1){
-		if(opt == 'l'){
-			yy_flex_debug = 1;
-		}else if(opt == 'y'){
-			yydebug = 1;
-		}else if(opt == '@'){
-			set_debugflags(optarg);
-		}else if(opt == 'D'){
-			command +="-D"+string(optarg)+" ";
-		}else{
-			fprintf(stderr,"Invalid argument used. Avaliable args:"
-				" [-ly] [-@] [-D]\n");
+	stats::set(stats::OIL_LINES, lines);
+}
+
+//Options shared by every file compiled
+static bool use_flat = false;          //walk the flattened tree
+static bool use_external_cpp = false;  //pipe through cpp instead
+static bool use_raw = false;           //nothing to preprocess
+static string cpp_command = CPP + " ";
+static preprocessor preproc;
+static bool use_debugflags = false;    //-@ was given
+static int threads = 1;                //checking and generating functions
+static bool use_folding = true;        //fold constant expressions
+
+//Does the work of compile()
+static int compile_file(const string& filename){
+	//Piece together the cpp command
+	string command = cpp_command + filename;
+	DEBUGF('s',"%s\n",command);
+	//Get the source text first so the cache can be checked
+	string base = filename.substr(0,filename.find("."));
+	string source;
+	mapfile raw_source;
+	if(use_raw){
+		if(!raw_source.open(filename)){
+			fprintf(stderr,"%s: %s\n", filename.c_str(),
+				strerror(errno));
 			return 1;
 		}
 	}
-	//Piece together the cpp command
-	command += string(filename);
-	DEBUGF('s',"%s\n",command);
+	else if(!use_external_cpp){
+		stats::timer timer(stats::PREPROCESS);
+		preproc.run(filename, source);
+	}
+	//Debug output can not be replayed from the cache, so skip it then
+	string cache_key;
+	if(!compile_cache::directory.empty() && !use_external_cpp
+			&& !use_debugflags && !yydebug && !yy_flex_debug
+			&& !compile_cache::compiler().empty()){
+		stats::timer timer(stats::CACHE);
+		string flags = string(use_flat ? "f" : "") + (use_raw ? "r" : "")
+			+ (ir_function::enabled ? "" : "n") + (use_folding ? "" : "c")
+			+ " " + to_string(ast_indent_limit) + " " + cpp_command
+			+ " " + compile_cache::compiler();
+		cache_key = use_raw
+			? compile_cache::key(flags, raw_source.data(),
+				raw_source.size())
+			: compile_cache::key(flags, source.data(), source.size());
+		if(compile_cache::restore(cache_key, base)){
+			return 0;
+		}
+	}
 	//Create tok file, the tok file is created as yyparse runs
 	string tok_file_name = filename.substr(0,filename.find("."))+".tok";
-	astree::setFile(tok_file_name);
+	if(!astree::setFile(tok_file_name)){
+		fprintf(stderr, "Error opening file");
+		return 1;
+	}
 	string sym_file_name = filename.substr(0,filename.find("."))+".sym";
-	sym_file = fopen(sym_file_name.c_str(), "w");
+	if(!sym_file.open(sym_file_name)){
+		astree::closeFile();
+		fprintf(stderr, "Error opening file");
+		return 1;
+	}
 	string ast_file_name = filename.substr(0,filename.find("."))+".ast";
 	string oil_file_name = filename.substr(0,filename.find("."))+".oil";
-	oil_file = fopen(oil_file_name.c_str(), "w");
+	if(!oil_file.open(oil_file_name)){
+		astree::closeFile();
+		sym_file.close();
+		fprintf(stderr, "Error opening file");
+		return 1;
+	}
 
-	FILE* ast_file;
-	ast_file = fopen(ast_file_name.c_str(), "w");
-	yyin = popen(command.c_str(), "r");
-	int parse_rc = yyparse();
-	astree::closeFile();
+	outbuf ast_file;
+	if(!ast_file.open(ast_file_name)){
+		astree::closeFile();
+		sym_file.close();
+		oil_file.close();
+		fprintf(stderr, "Error opening file");
+		return 1;
+	}
+	if(use_external_cpp){
+		yyin = popen(command.c_str(), "r");
+	}
+	else if(use_raw){
+		//Scan straight out of the mapped file
+		lexer::newfilename(filename);
+		lexer::scan_buffer(raw_source.data(), raw_source.size());
+	}
+	else{
+		//Flex wants two NULs after the text it scans in place
+		size_t length = source.size();
+		source.append(2, '\0');
+		lexer::scan_buffer(&source[0], length);
+	}
+	int parse_rc;
+	{
+		stats::timer timer(stats::PARSE);
+		parse_rc = yyparse();
+		astree::closeFile();
+	}
+	stats::set(stats::NODES, astree::nodes.allocations());
 	if(parse_rc){
 		errprintf("parse failed (%d)\n", parse_rc);
 	}
 	else{
 
-		semantic_analysis(parser::root);
-		if(pclose(sym_file) != 0) return 1;
-		astree::print(ast_file,parser::root);
-		if(pclose(ast_file) != 0) return 1;
+		{
+			stats::timer timer(stats::SEMANTIC);
+			semantic_analysis(parser::root, threads, use_folding);
+			if(sym_file.close() != 0) return 1;
+		}
+		flat_tree flat;
+		{
+			stats::timer timer(stats::AST);
+			if(use_flat){
+				flat.build(parser::root);
+				flat.print(ast_file);
+			}
+			else astree::print(ast_file,parser::root);
+			if(ast_file.close() != 0) return 1;
+		}
 
 		//Do the oil file thingy
-		fprintf(oil_file,"#define __OCLIB_C__\n");
-		fprintf(oil_file,"#include \"oclib.oh\"\n\n");
-		make_oil_file();
-		if(pclose(oil_file) != 0) return 1;
-		delete parser::root;
+		{
+			stats::timer timer(stats::OIL);
+			oil_file.printf("#define __OCLIB_C__\n");
+			oil_file.printf("#include \"oclib.oh\"\n\n");
+			make_oil_file(use_flat ? &flat : nullptr, threads);
+			if(oil_file.close() != 0) return 1;
+		}
+		stats::set(stats::VREGS, vregcounter);
+		if(stats::enabled) count_oil_lines(oil_file_name);
+	}
+	{
+		stats::timer timer(stats::RELEASE);
+		astree::release();
+		symbol::release();
 	}
 	//Dump the string_set into a file
 
 	string project_stringADT_file = filename.substr(0,
 			filename.find("."))+".str";
 
-	FILE* str_file;
-	str_file = fopen(project_stringADT_file.c_str(), "w");
-	if(str_file == NULL){ 
+	outbuf str_file;
+	if(!str_file.open(project_stringADT_file)){ 
 		fprintf(stderr, "Error opening file");
 		return 1;
 	}
-	string_set::dump(str_file);
-	if(pclose(str_file) != 0) return 1;
+	stats::set(stats::STRINGS, string_set::size());
+	{
+		stats::timer timer(stats::STR);
+		string_set::dump(str_file);
+		if(str_file.close() != 0) return 1;
+	}
+	//Only clean compiles go in the cache, errors are not replayed
+	if(!cache_key.empty() && exec::exit_status == EXIT_SUCCESS){
+		compile_cache::store(cache_key, base);
+	}
 	
 	return 0;
 }
+
+//Compiles one .oc file into its .tok, .ast, .sym, .oil and .str
+//files and prints --stats for it.  Returns the exit status.
+int compile(const string& filename){
+	int rc = compile_file(filename);
+	if(stats::enabled) stats::print(stderr, filename.c_str());
+	return rc;
+}
+
+//One file of a batch.  The scanner, parser and symbol tables are all
+//global, so each file is compiled in its own forked child, which
+//starts from the clean state left by option parsing.  Its stderr goes
+//to a temporary file so diagnostics come out in command line order.
+struct batch_job {
+	string filename;
+	pid_t pid = 0;
+	FILE* errors = nullptr;
+	int status = 0;
+	bool done = false;
+};
+
+static void start_job(batch_job& job){
+	job.errors = tmpfile();
+	if(job.errors == nullptr){
+		syserrprintf("tmpfile");
+		job.status = EXIT_FAILURE << 8;
+		job.done = true;
+		return;
+	}
+	fflush(NULL);
+	job.pid = fork();
+	if(job.pid < 0){
+		syserrprintf("fork");
+		job.status = EXIT_FAILURE << 8;
+		job.done = true;
+	}
+	else if(job.pid == 0){
+		dup2(fileno(job.errors), STDERR_FILENO);
+		int rc = compile(job.filename);
+		fflush(NULL);
+		_exit(rc);
+	}
+}
+
+//Copies a finished job's diagnostics to stderr and reports how the
+//child ended if it did not exit cleanly.
+static void finish_job(batch_job& job){
+	if(job.errors != nullptr){
+		rewind(job.errors);
+		char buffer[LINESIZE];
+		size_t count;
+		while((count = fread(buffer, 1, sizeof buffer, job.errors)) > 0){
+			fwrite(buffer, 1, count, stderr);
+		}
+		fclose(job.errors);
+		job.errors = nullptr;
+	}
+	if(WIFSIGNALED(job.status)) eprint_status(job.filename.c_str(),
+			job.status);
+}
+
+//Compiles every file, at most jobs at a time.  Returns the highest
+//exit status of any file.
+static int compile_batch(const vector<string>& filenames, int jobs){
+	vector<batch_job> batch(filenames.size());
+	for(size_t i = 0; i < batch.size(); ++i){
+		batch[i].filename = filenames[i];
+	}
+	size_t next_start = 0;
+	size_t next_report = 0;
+	int running = 0;
+	int exit_status = 0;
+	while(next_report < batch.size()){
+		while(running < jobs && next_start < batch.size()){
+			start_job(batch[next_start]);
+			if(!batch[next_start].done) ++running;
+			++next_start;
+		}
+		if(running > 0){
+			int status;
+			pid_t pid = wait(&status);
+			if(pid < 0){
+				syserrprintf("wait");
+				return EXIT_FAILURE;
+			}
+			for(auto& job: batch){
+				if(job.pid != pid || job.done) continue;
+				job.status = status;
+				job.done = true;
+				--running;
+			}
+		}
+		//Report finished files in command line order
+		while(next_report < batch.size() && batch[next_report].done){
+			batch_job& job = batch[next_report++];
+			finish_job(job);
+			int rc = WIFEXITED(job.status) ? WEXITSTATUS(job.status)
+				: EXIT_FAILURE;
+			if(rc > exit_status) exit_status = rc;
+		}
+	}
+	return exit_status;
+}
+
+//Socket for --server and --client
+static string server_socket;
+static string client_socket;
+//Print the cache counters after compiling
+static bool show_cache_stats = false;
+
+static const struct option long_options[] = {
+	{"server", required_argument, nullptr, 'S'},
+	{"client", required_argument, nullptr, 'C'},
+	{"cache", required_argument, nullptr, 'K'},
+	{"cache-size", required_argument, nullptr, 'Z'},
+	{"cache-stats", no_argument, nullptr, 'T'},
+	{"stats", optional_argument, nullptr, 'M'},
+	{"threads", required_argument, nullptr, 'H'},
+	{"no-ir", no_argument, nullptr, 'N'},
+	{"no-fold", no_argument, nullptr, 'O'},
+	{"ast-indent", required_argument, nullptr, 'I'},
+	{nullptr, 0, nullptr, 0},
+};
+
+//Gets the command line argments into the option variables and the
+//list of files.  Returns nonzero if they are bad.
+static int parse_options(int argc, char** argv, vector<string>& files,
+		int& jobs){
+	int opt;
+	while((opt = getopt_long(argc, argv, "lyfapr@:D:j:", long_options,
+			nullptr)) != -1){
+		if(opt == 'l'){
+			yy_flex_debug = 1;
+		}else if(opt == 'y'){
+			yydebug = 1;
+		}else if(opt == 'f'){
+			use_flat = true;
+		}else if(opt == 'a'){
+			//Write the output files from a background thread
+			outbuf::background = true;
+		}else if(opt == 'p'){
+			use_external_cpp = true;
+		}else if(opt == 'r'){
+			use_raw = true;
+		}else if(opt == '@'){
+			set_debugflags(optarg);
+			use_debugflags = true;
+		}else if(opt == 'D'){
+			cpp_command +="-D"+string(optarg)+" ";
+			if(!preproc.define(optarg)) return 1;
+		}else if(opt == 'j'){
+			jobs = atoi(optarg);
+			if(jobs < 1){
+				fprintf(stderr,"-j needs a positive number\n");
+				return 1;
+			}
+		}else if(opt == 'K'){
+			compile_cache::directory = optarg;
+		}else if(opt == 'Z'){
+			compile_cache::size_limit = strtoull(optarg, nullptr, 10)
+				<< 20;
+		}else if(opt == 'T'){
+			show_cache_stats = true;
+		}else if(opt == 'M'){
+			stats::enabled = true;
+			if(optarg == nullptr || strcmp(optarg, "text") == 0){
+				stats::output = stats::TEXT;
+			}else if(strcmp(optarg, "json") == 0){
+				stats::output = stats::JSON;
+			}else{
+				fprintf(stderr,"--stats takes text or json\n");
+				return 1;
+			}
+		}else if(opt == 'H'){
+			threads = atoi(optarg);
+			if(threads < 1){
+				fprintf(stderr,"--threads needs a positive number\n");
+				return 1;
+			}
+		}else if(opt == 'N'){
+			ir_function::enabled = false;
+		}else if(opt == 'O'){
+			use_folding = false;
+		}else if(opt == 'I'){
+			ast_indent_limit = atoi(optarg);
+			if(ast_indent_limit < 0){
+				fprintf(stderr,"--ast-indent needs a number of levels\n");
+				return 1;
+			}
+		}else if(opt == 'S'){
+			server_socket = optarg;
+		}else if(opt == 'C'){
+			client_socket = optarg;
+		}else{
+			fprintf(stderr,"Invalid argument used. Avaliable args:"
+				" [-lyfapr] [-@] [-D] [-j] [--server] [--client]"
+				" [--cache] [--cache-size] [--cache-stats]"
+				" [--stats] [--threads] [--no-ir] [--no-fold]"
+				" [--ast-indent]\n");
+			return 1;
+		}
+	}
+	for(int i = optind; i < argc; ++i) files.push_back(argv[i]);
+	return 0;
+}
+
+//Gets the file names check file extension and what not
+static int check_filenames(vector<string>& files){
+	if(files.empty()){
+		fprintf(stderr,"No program.oc given\n");
+		return 1;
+	}
+	for(auto& filename: files){
+		vector<char> path(filename.begin(), filename.end());
+		path.push_back('\0');
+		filename = basename(path.data());
+		if(filename.substr(filename.find_last_of(".") + 1)
+				.compare("oc") != 0){
+			fprintf(stderr,"File extension does not match\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Makes the --cache directory if it is not there yet
+static int prepare_cache(){
+	if(compile_cache::directory.empty()){
+		if(!show_cache_stats) return 0;
+		fprintf(stderr,"--cache-stats needs --cache\n");
+		return 1;
+	}
+	if(mkdir(compile_cache::directory.c_str(), 0777) != 0
+			&& errno != EEXIST){
+		syserrprintf(compile_cache::directory.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+static int compile_files(const vector<string>& filenames, int jobs){
+	if(filenames.size() == 1) return compile(filenames[0]);
+	return compile_batch(filenames, jobs);
+}
+
+//Handles one request in a child of the compile server
+static int serve_request(const vector<string>& args,
+		vector<string>& outputs){
+	vector<string> copies(args);
+	vector<char*> argv;
+	argv.push_back(&exec::execname[0]);
+	for(auto& arg: copies) argv.push_back(&arg[0]);
+	argv.push_back(nullptr);
+	//Start getopt over on the new argument vector
+	optind = 0;
+	server_socket.clear();
+	vector<string> filenames;
+	int jobs = 1;
+	int rc = parse_options(argv.size() - 1, argv.data(), filenames, jobs);
+	if(rc != 0) return rc;
+	if(!server_socket.empty() || !client_socket.empty()){
+		fprintf(stderr,"--server and --client can not be sent"
+			" to a server\n");
+		return 1;
+	}
+	rc = check_filenames(filenames);
+	if(rc == 0) rc = prepare_cache();
+	if(rc != 0) return rc;
+	rc = compile_files(filenames, jobs);
+	for(const auto& filename: filenames){
+		string base = filename.substr(0,filename.find("."));
+		for(const char* suffix: {".tok", ".ast", ".sym", ".oil", ".str"}){
+			if(access((base + suffix).c_str(), F_OK) == 0){
+				outputs.push_back(base + suffix);
+			}
+		}
+	}
+	return rc;
+}
+
+int main(int argc, char** argv){
+	exec::execname = basename(argv[0]);
+	//Check for arguments, prints usage
+	if(argc == 1){
+		fprintf(stderr,"Usage: oc [-lyfapr] [-@ flag...] [-D string]"
+			" [-j jobs] [--client socket]\n"
+			"          [--cache dir] [--cache-size MB] [--cache-stats]"
+			" [--stats[=json]] [--threads N] [--no-ir]"
+			" [--no-fold]\n"
+			"          [--ast-indent N] program.oc...\n"
+			"       oc [-@ flag...] [-D string] --server socket"
+			" [prelude.oh...]\n");
+		return 1;
+	}
+	//Keep the arguments as given, getopt reorders argv
+	vector<string> args(argv + 1, argv + argc);
+	//Commented out both ints so that the compileri doesn't complain
+	yy_flex_debug = 0;
+	yydebug	      = 0;
+	//Number of files compiled at once
+	int jobs = 1;
+	vector<string> filenames;
+	int rc = parse_options(argc, argv, filenames, jobs);
+	if(rc != 0) return rc;
+	if(!client_socket.empty()){
+		//Send everything but --client itself
+		vector<string> request;
+		for(size_t i = 0; i < args.size(); ++i){
+			if(args[i] == "--client") ++i;
+			else if(args[i].compare(0, 9, "--client=") != 0){
+				request.push_back(args[i]);
+			}
+		}
+		return run_client(client_socket, request);
+	}
+	if(!server_socket.empty()){
+		//The remaining arguments are headers to keep in memory
+		for(const auto& prelude: filenames){
+			if(!preprocessor::preload(prelude)){
+				syserrprintf(prelude.c_str());
+				return 1;
+			}
+		}
+		return run_server(server_socket, serve_request);
+	}
+	rc = prepare_cache();
+	if(rc != 0) return rc;
+	//--cache-stats on its own just reports
+	if(show_cache_stats && filenames.empty()){
+		compile_cache::print_stats(stdout);
+		return 0;
+	}
+	rc = check_filenames(filenames);
+	if(rc != 0) return rc;
+	rc = compile_files(filenames, jobs);
+	if(show_cache_stats) compile_cache::print_stats(stdout);
+	return rc;
+}
@@ -0,0 +1,229 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "astree.h"
+#include "outbuf.h"
+
+bool outbuf::background = false;
+constexpr size_t outbuf::buffer_size;
+
+//
+// Single writer thread shared by all background outbufs.  Jobs are
+// written in the order they were queued, and spent buffers are kept
+// for reuse so that steady-state output does not allocate.
+//
+
+struct outbuf_writer {
+   struct job {
+      outbuf* owner;
+      vector<char> data;
+      size_t len;
+   };
+   mutex lock;
+   condition_variable queued;
+   condition_variable drained;
+   deque<job> jobs;
+   vector<vector<char>> spare;
+   bool busy = false;
+
+   outbuf_writer() {
+      thread ([this] { run(); }).detach();
+   }
+
+   static outbuf_writer& get() {
+      // Never destroyed, so late outbuf destructors stay safe.
+      static outbuf_writer* writer = new outbuf_writer();
+      return *writer;
+   }
+
+   void run() {
+      for (;;) {
+         unique_lock<mutex> guard (lock);
+         queued.wait (guard, [this] { return not jobs.empty(); });
+         job next = move (jobs.front());
+         jobs.pop_front();
+         busy = true;
+         guard.unlock();
+         next.owner->write_out (next.data.data(), next.len);
+         guard.lock();
+         spare.push_back (move (next.data));
+         busy = false;
+         if (jobs.empty()) drained.notify_all();
+      }
+   }
+
+   vector<char> submit (outbuf* owner, vector<char>& data, size_t len) {
+      lock_guard<mutex> guard (lock);
+      jobs.push_back ({owner, move (data), len});
+      queued.notify_one();
+      if (spare.empty()) return vector<char> (outbuf::buffer_size);
+      vector<char> result = move (spare.back());
+      spare.pop_back();
+      return result;
+   }
+
+   void drain() {
+      unique_lock<mutex> guard (lock);
+      drained.wait (guard, [this] { return jobs.empty() and not busy; });
+   }
+};
+
+outbuf::~outbuf() {
+   if (is_open()) close();
+}
+
+bool outbuf::open (const string& filename) {
+   assert (not is_open());
+   fd = ::open (filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd < 0) return false;
+   buffer.resize (buffer_size);
+   used = 0;
+   failed = false;
+   threaded = background;
+   in_memory = false;
+   return true;
+}
+
+void outbuf::open_memory() {
+   assert (not is_open());
+   buffer.resize (0x1000);
+   used = 0;
+   failed = false;
+   threaded = false;
+   in_memory = true;
+}
+
+int outbuf::close() {
+   if (not is_open()) return -1;
+   flush();
+   if (threaded) outbuf_writer::get().drain();
+   if (::close (fd) != 0) failed = true;
+   fd = -1;
+   return failed ? -1 : 0;
+}
+
+void outbuf::write_out (const char* data, size_t len) {
+   while (len > 0) {
+      ssize_t count = ::write (fd, data, len);
+      if (count < 0) {
+         if (errno == EINTR) continue;
+         failed = true;
+         return;
+      }
+      data += count;
+      len -= count;
+   }
+}
+
+void outbuf::flush() {
+   if (used == 0 or in_memory) return;
+   if (threaded) {
+      buffer = outbuf_writer::get().submit (this, buffer, used);
+   }else {
+      write_out (buffer.data(), used);
+   }
+   used = 0;
+}
+
+// Called when len more bytes do not fit in the buffer.  Returns false
+// if the outbuf is not open, so there is nowhere for them to go; they
+// are dropped, and close reports the failure.
+bool outbuf::make_room (size_t len) {
+   if (in_memory) {
+      buffer.resize (max (2 * buffer.size(), used + len));
+   }else if (fd < 0) {
+      failed = true;
+      return false;
+   }else {
+      flush();
+   }
+   return true;
+}
+
+void outbuf::put (const char* str, size_t len) {
+   if (len > buffer.size() - used) {
+      if (not make_room (len)) return;
+      if (len > buffer.size()) {
+         if (threaded) outbuf_writer::get().drain();
+         write_out (str, len);
+         return;
+      }
+   }
+   memcpy (buffer.data() + used, str, len);
+   used += len;
+}
+
+void outbuf::put (const char* str) {
+   put (str, strlen (str));
+}
+
+void outbuf::put (const interned& str) {
+   put (str.data(), str.size());
+}
+
+void outbuf::pad (size_t len, int width) {
+   for (int fill = abs (width) - int (len); fill > 0; --fill) put (' ');
+}
+
+void outbuf::put_int (long long value, int width) {
+   char digits[24];
+   char* end = digits + sizeof digits;
+   char* start = end;
+   unsigned long long magnitude = value;
+   if (value < 0) magnitude = 0 - magnitude;
+   do {
+      *--start = '0' + magnitude % 10;
+      magnitude /= 10;
+   }while (magnitude != 0);
+   if (value < 0) *--start = '-';
+   size_t len = end - start;
+   if (width > 0) pad (len, width);
+   put (start, len);
+   if (width < 0) pad (len, width);
+}
+
+void outbuf::put_str (const char* str, int width) {
+   size_t len = strlen (str);
+   if (width > 0) pad (len, width);
+   put (str, len);
+   if (width < 0) pad (len, width);
+}
+
+void outbuf::put_loc (const location& lloc) {
+   put_int (lloc.filenr);
+   put ('.');
+   put_int (lloc.linenr);
+   put ('.');
+   put_int (lloc.offset);
+}
+
+void outbuf::printf (const char* format, ...) {
+   va_list args;
+   va_start (args, format);
+   size_t room = buffer.size() - used;
+   int len = vsnprintf (buffer.data() + used, room, format, args);
+   va_end (args);
+   assert (len >= 0);
+   if (size_t (len) < room) {
+      used += len;
+      return;
+   }
+   // Did not fit: format into a buffer of the right size instead.
+   vector<char> text (len + 1);
+   va_start (args, format);
+   vsnprintf (text.data(), text.size(), format, args);
+   va_end (args);
+   put (text.data(), len);
+}
+
@@ -0,0 +1,79 @@
+#ifndef __OUTBUF_H__
+#define __OUTBUF_H__
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct location;
+struct interned;
+
+//
+// DESCRIPTION
+//    Buffered output for the compiler's artifacts.  Each file has a
+//    large private buffer that is filled with hand-formatted text and
+//    written with write(2) when full.  If background is set before a
+//    file is opened, full buffers are handed to a writer thread so
+//    that the disk writes overlap with compilation.
+//
+
+struct outbuf {
+   static bool background;
+
+   outbuf() {}
+   ~outbuf();
+   outbuf (const outbuf&) = delete;
+   outbuf& operator= (const outbuf&) = delete;
+
+   bool open (const string& filename);
+   // Creates or truncates filename.  Returns false on failure.
+
+   void open_memory();
+   // Collects the text in memory instead, for output that has to be
+   // put in order later.  data() and size() give it back.
+   const char* data() const { return buffer.data(); }
+   size_t size() const { return used; }
+   void clear() { used = 0; }
+
+   int close();
+   // Flushes and closes.  Returns 0, or -1 if any write failed.
+
+   void flush();
+   bool is_open() const { return fd >= 0; }
+
+   void put (char chr) {
+      if (used == buffer.size() and not make_room (1)) return;
+      buffer[used++] = chr;
+   }
+   void put (const char* str, size_t len);
+   void put (const char* str);
+   void put (const string& str) { put (str.data(), str.size()); }
+   void put (const interned& str);
+
+   void put_int (long long value, int width = 0);
+   void put_str (const char* str, int width = 0);
+   // A positive width right-justifies, a negative width
+   // left-justifies, as with the printf flags %5d and %-5d.
+
+   void put_loc (const location& lloc);
+   // Writes filenr.linenr.offset.
+
+   void printf (const char* format, ...)
+        __attribute__ ((format (printf, 2, 3)));
+
+   private:
+      static constexpr size_t buffer_size = 0x40000;
+      int fd = -1;
+      bool failed = false;
+      bool threaded = false;
+      bool in_memory = false;
+      vector<char> buffer;
+      size_t used = 0;
+      bool make_room (size_t len);
+      void pad (size_t len, int width);
+      void write_out (const char* data, size_t len);
+      friend struct outbuf_writer;
+};
+
+#endif
+
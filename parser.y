@@ -6,6 +6,11 @@
 #include "lyutils.h"
 #include "astree.h"
 
+// Machine-generated programs nest far deeper than bison's default
+// limit of 10000.  The stacks are on the heap and only grow as
+// needed; lyutils.h marks YYSTYPE trivial so that they can.
+#define YYMAXDEPTH 20000000
+
 %}
 
 %debug
@@ -0,0 +1,821 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <map>
+#include <memory>
+
+#include "auxlib.h"
+#include "mapfile.h"
+#include "preproc.h"
+
+// Piece of a logical line that sits on one physical line.
+struct source_part {
+   string text;
+   size_t linenr;
+   size_t indent;     // column of its first token
+};
+
+// One line after comments and backslash-newlines are removed.  It
+// is kept in parts so tokens can be put back on their own lines.
+struct source_line {
+   vector<source_part> parts;
+   string text() const {
+      string result;
+      for (const auto& part: parts) result += part.text;
+      return result;
+   }
+};
+
+static bool ident_start (char chr) {
+   return isalpha (static_cast<unsigned char> (chr)) or chr == '_';
+}
+
+static bool ident_char (char chr) {
+   return isalnum (static_cast<unsigned char> (chr)) or chr == '_';
+}
+
+// Files mapped by preload, by device and inode.  An entry is only
+// used while the size and modification time still match.
+struct preloaded_file {
+   mapfile text;
+   off_t size;
+   struct timespec mtime;
+};
+static map<pair<dev_t,ino_t>,unique_ptr<preloaded_file>> preloaded;
+
+static const mapfile* find_preloaded (const string& path) {
+   if (preloaded.empty()) return nullptr;
+   struct stat info;
+   if (stat (path.c_str(), &info) != 0) return nullptr;
+   auto found = preloaded.find ({info.st_dev, info.st_ino});
+   if (found == preloaded.end()) return nullptr;
+   const preloaded_file& file = *found->second;
+   if (file.size != info.st_size
+       or file.mtime.tv_sec != info.st_mtim.tv_sec
+       or file.mtime.tv_nsec != info.st_mtim.tv_nsec) return nullptr;
+   return &file.text;
+}
+
+bool preprocessor::preload (const string& path) {
+   unique_ptr<preloaded_file> file (new preloaded_file);
+   struct stat info;
+   if (stat (path.c_str(), &info) != 0) return false;
+   if (not file->text.open (path)) return false;
+   file->size = info.st_size;
+   file->mtime = info.st_mtim;
+   preloaded[{info.st_dev, info.st_ino}] = move (file);
+   return true;
+}
+
+// Bytes of a mapped source file.
+struct text_view {
+   const char* base;
+   size_t length;
+   size_t size() const { return length; }
+   char operator[] (size_t pos) const { return base[pos]; }
+};
+
+// Returns the position just past the string or character literal
+// that starts at pos.  An unterminated literal ends at the newline.
+template <typename text_type>
+static size_t skip_literal (const text_type& text, size_t pos) {
+   char quote = text[pos++];
+   while (pos < text.size() and text[pos] != quote
+          and text[pos] != '\n') {
+      if (text[pos] == '\\' and pos + 1 < text.size()) ++pos;
+      ++pos;
+   }
+   return pos < text.size() and text[pos] == quote ? pos + 1 : pos;
+}
+
+static size_t skip_space (const string& text, size_t pos) {
+   while (pos < text.size() and isspace (text[pos])) ++pos;
+   return pos;
+}
+
+// Squeezes runs of white space outside literals to one space and
+// trims both ends.
+static string normalize (const string& text) {
+   string result;
+   for (size_t pos = skip_space (text, 0); pos < text.size();) {
+      if (text[pos] == '"' or text[pos] == '\'') {
+         size_t end = skip_literal (text, pos);
+         result.append (text, pos, end - pos);
+         pos = end;
+      }else if (isspace (text[pos])) {
+         pos = skip_space (text, pos);
+         if (pos < text.size()) result += ' ';
+      }else {
+         result += text[pos++];
+      }
+   }
+   return result;
+}
+
+static string trim (const string& text) {
+   size_t begin = skip_space (text, 0);
+   size_t end = text.size();
+   while (end > begin and isspace (text[end - 1])) --end;
+   return text.substr (begin, end - begin);
+}
+
+// Splits a file into logical lines the way translation phases 1-3
+// do: backslash-newline joins lines and each comment becomes one
+// space.  A new part starts whenever a logical line continues onto
+// another physical line.
+static vector<source_line> split_lines (const text_view& text) {
+   vector<source_line> lines;
+   source_line line;
+   size_t linenr = 1;
+   size_t column = 0;
+   auto new_part = [&line, &linenr] () {
+      line.parts.push_back ({"", linenr, string::npos});
+   };
+   new_part();
+   for (size_t pos = 0; pos < text.size();) {
+      source_part* part = &line.parts.back();
+      char chr = text[pos];
+      if (chr == '\\' and pos + 1 < text.size()
+          and text[pos + 1] == '\n') {
+         pos += 2;
+         ++linenr;
+         column = 0;
+         new_part();
+      }else if (chr == '\n') {
+         lines.push_back (line);
+         ++pos;
+         ++linenr;
+         column = 0;
+         line.parts.clear();
+         new_part();
+      }else if (chr == '/' and pos + 1 < text.size()
+                and text[pos + 1] == '/') {
+         while (pos < text.size() and text[pos] != '\n') ++pos;
+         part->text += ' ';
+      }else if (chr == '/' and pos + 1 < text.size()
+                and text[pos + 1] == '*') {
+         part->text += ' ';
+         pos += 2;
+         column += 2;
+         while (pos < text.size() and not (text[pos] == '*'
+                and pos + 1 < text.size() and text[pos + 1] == '/')) {
+            if (text[pos] == '\n') {
+               ++linenr;
+               column = 0;
+               new_part();
+            }else {
+               ++column;
+            }
+            ++pos;
+         }
+         pos += 2;
+         column += 2;
+      }else if (chr == '"' or chr == '\'') {
+         if (part->indent == string::npos) part->indent = column;
+         size_t end = skip_literal (text, pos);
+         part->text.append (text.base + pos, end - pos);
+         column += end - pos;
+         pos = end;
+      }else {
+         if (part->indent == string::npos and not isspace (chr)) {
+            part->indent = column;
+         }
+         part->text += chr;
+         ++column;
+         ++pos;
+      }
+   }
+   if (line.parts.size() > 1 or not line.parts[0].text.empty()) {
+      lines.push_back (line);
+   }
+   return lines;
+}
+
+// Breaks macro text into identifiers, numbers, literals, "##",
+// runs of white space and single characters.
+static vector<string> tokenize (const string& text) {
+   vector<string> tokens;
+   for (size_t pos = 0; pos < text.size();) {
+      size_t end = pos + 1;
+      char chr = text[pos];
+      if (chr == '"' or chr == '\'') {
+         end = skip_literal (text, pos);
+      }else if (ident_start (chr) or isdigit (chr)) {
+         while (end < text.size()
+                and (ident_char (text[end]) or text[end] == '.')) ++end;
+      }else if (isspace (chr)) {
+         end = skip_space (text, pos);
+      }else if (chr == '#' and end < text.size() and text[end] == '#') {
+         ++end;
+      }
+      tokens.push_back (text.substr (pos, end - pos));
+      pos = end;
+   }
+   return tokens;
+}
+
+static string stringize (const string& arg) {
+   string result = "\"";
+   for (char chr: normalize (arg)) {
+      if (chr == '"' or chr == '\\') result += '\\';
+      result += chr;
+   }
+   return result + "\"";
+}
+
+// Collects the arguments of a function-like macro call.  pos is at
+// the opening parenthesis and is left just past the closing one.
+static bool collect_args (const string& text, size_t& pos,
+                          vector<string>& args) {
+   int depth = 0;
+   string arg;
+   for (++pos; pos < text.size();) {
+      char chr = text[pos];
+      if (chr == '"' or chr == '\'') {
+         size_t end = skip_literal (text, pos);
+         arg.append (text, pos, end - pos);
+         pos = end;
+         continue;
+      }
+      ++pos;
+      if (chr == ')' and depth == 0) {
+         args.push_back (trim (arg));
+         return true;
+      }
+      if (chr == ',' and depth == 0) {
+         args.push_back (trim (arg));
+         arg.clear();
+         continue;
+      }
+      if (chr == '(') ++depth;
+      if (chr == ')') --depth;
+      arg += chr;
+   }
+   return false;
+}
+
+void preprocessor::error (const string& message) {
+   errprintf ("%s:%zu: %s\n", cur_file.c_str(), cur_line,
+              message.c_str());
+   failed = true;
+}
+
+bool preprocessor::define (const string& option) {
+   string line = option;
+   size_t equal = line.find ('=');
+   if (equal == string::npos) line += " 1";
+                         else line[equal] = ' ';
+   cur_file = "<command-line>";
+   cur_line = 0;
+   failed = false;
+   define_line (line);
+   return not failed;
+}
+
+void preprocessor::define_line (const string& text) {
+   size_t pos = skip_space (text, 0);
+   size_t end = pos;
+   while (end < text.size() and ident_char (text[end])) ++end;
+   if (end == pos or not ident_start (text[pos])) {
+      error ("macro names must be identifiers");
+      return;
+   }
+   string name = text.substr (pos, end - pos);
+   macro mac;
+   if (end < text.size() and text[end] == '(') {
+      mac.function = true;
+      size_t close = text.find (')', end);
+      if (close == string::npos) {
+         error ("missing ')' in macro parameter list");
+         return;
+      }
+      string params = text.substr (end + 1, close - end - 1);
+      if (not trim (params).empty()) {
+         size_t start = 0;
+         for (;;) {
+            size_t comma = params.find (',', start);
+            string param = trim (params.substr (start, comma - start));
+            mac.params.push_back (param == "..." ? "__VA_ARGS__" : param);
+            if (comma == string::npos) break;
+            start = comma + 1;
+         }
+      }
+      end = close + 1;
+   }
+   mac.body = normalize (text.substr (end));
+   macros[name] = mac;
+}
+
+string preprocessor::substitute (const macro& mac,
+                                 const vector<string>& args,
+                                 unordered_set<string>& disabled) {
+   auto param_index = [&mac] (const string& token) {
+      for (size_t index = 0; index < mac.params.size(); ++index) {
+         if (mac.params[index] == token) return int (index);
+      }
+      return -1;
+   };
+   vector<string> tokens = tokenize (mac.body);
+   auto next_token = [&tokens] (size_t index) {
+      ++index;
+      while (index < tokens.size() and isspace (tokens[index][0])) {
+         ++index;
+      }
+      return index;
+   };
+   string result;
+   bool pasting = false;
+   for (size_t index = 0; index < tokens.size(); ++index) {
+      const string& token = tokens[index];
+      size_t next = next_token (index);
+      if (token == "#" and next < tokens.size()
+          and param_index (tokens[next]) >= 0) {
+         result += stringize (args[param_index (tokens[next])]);
+         index = next;
+         pasting = false;
+         continue;
+      }
+      if (token == "##") {
+         while (not result.empty() and isspace (result.back())) {
+            result.pop_back();
+         }
+         index = next - 1;
+         pasting = true;
+         continue;
+      }
+      int param = param_index (token);
+      if (param >= 0) {
+         bool raw = pasting or (next < tokens.size()
+                                and tokens[next] == "##");
+         result += raw ? args[param] : expand (args[param], disabled);
+      }else {
+         result += token;
+      }
+      pasting = false;
+   }
+   return result;
+}
+
+string preprocessor::expand (const string& text,
+                             unordered_set<string>& disabled) {
+   string result;
+   for (size_t pos = 0; pos < text.size();) {
+      char chr = text[pos];
+      if (chr == '"' or chr == '\'') {
+         size_t end = skip_literal (text, pos);
+         result.append (text, pos, end - pos);
+         pos = end;
+         continue;
+      }
+      if (isdigit (chr)) {
+         size_t end = pos;
+         while (end < text.size()
+                and (ident_char (text[end]) or text[end] == '.')) ++end;
+         result.append (text, pos, end - pos);
+         pos = end;
+         continue;
+      }
+      if (not ident_start (chr)) {
+         result += chr;
+         ++pos;
+         continue;
+      }
+      size_t end = pos;
+      while (end < text.size() and ident_char (text[end])) ++end;
+      string name = text.substr (pos, end - pos);
+      pos = end;
+      if (name == "__FILE__") {
+         result += "\"" + cur_file + "\"";
+         continue;
+      }
+      if (name == "__LINE__") {
+         result += to_string (cur_line);
+         continue;
+      }
+      auto found = macros.find (name);
+      if (found == macros.end() or disabled.count (name)) {
+         result += name;
+         continue;
+      }
+      const macro& mac = found->second;
+      string body = mac.body;
+      if (mac.function) {
+         size_t paren = skip_space (text, pos);
+         if (paren >= text.size() or text[paren] != '(') {
+            result += name;
+            continue;
+         }
+         vector<string> args;
+         if (not collect_args (text, paren, args)) {
+            error ("unterminated argument list invoking macro \""
+                   + name + "\"");
+            result += name;
+            pos = text.size();
+            continue;
+         }
+         pos = paren;
+         if (mac.params.empty() and args.size() == 1
+             and args[0].empty()) args.clear();
+         if (args.size() != mac.params.size()) {
+            error ("macro \"" + name + "\" passed "
+                   + to_string (args.size()) + " arguments, but takes "
+                   + to_string (mac.params.size()));
+            continue;
+         }
+         body = substitute (mac, args, disabled);
+      }
+      disabled.insert (name);
+      result += expand (body, disabled);
+      disabled.erase (name);
+   }
+   return result;
+}
+
+//
+// #if expressions, by precedence climbing over a token list.
+//
+
+namespace {
+   struct expr_parser {
+      vector<string> tokens;
+      size_t pos = 0;
+      bool bad = false;
+
+      const string& peek() {
+         static const string end;
+         return pos < tokens.size() ? tokens[pos] : end;
+      }
+
+      static int precedence (const string& op) {
+         static const unordered_map<string,int> table {
+            {"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5},
+            {"==", 6}, {"!=", 6}, {"<", 7}, {">", 7}, {"<=", 7},
+            {">=", 7}, {"<<", 8}, {">>", 8}, {"+", 9}, {"-", 9},
+            {"*", 10}, {"/", 10}, {"%", 10},
+         };
+         auto found = table.find (op);
+         return found == table.end() ? 0 : found->second;
+      }
+
+      long long primary() {
+         string token = peek();
+         ++pos;
+         if (token == "(") {
+            long long value = ternary();
+            if (peek() != ")") bad = true;
+            ++pos;
+            return value;
+         }
+         if (token == "!") return not primary();
+         if (token == "~") return ~primary();
+         if (token == "-") return -primary();
+         if (token == "+") return primary();
+         if (token.empty()) {
+            bad = true;
+            return 0;
+         }
+         if (isdigit (token[0])) return strtoll (token.c_str(), nullptr, 0);
+         if (token[0] == '\'') {
+            if (token.size() > 3 and token[1] == '\\') {
+               switch (token[2]) {
+                  case 'n': return '\n';
+                  case 't': return '\t';
+                  case '0': return '\0';
+                  default: return token[2];
+               }
+            }
+            return token.size() > 2 ? token[1] : 0;
+         }
+         if (ident_start (token[0])) return 0;
+         bad = true;
+         return 0;
+      }
+
+      long long binary (int min_prec) {
+         long long left = primary();
+         for (;;) {
+            string op = peek();
+            int prec = precedence (op);
+            if (prec == 0 or prec < min_prec) return left;
+            ++pos;
+            long long right = binary (prec + 1);
+            if (op == "||") left = left or right;
+            else if (op == "&&") left = left and right;
+            else if (op == "|") left |= right;
+            else if (op == "^") left ^= right;
+            else if (op == "&") left &= right;
+            else if (op == "==") left = left == right;
+            else if (op == "!=") left = left != right;
+            else if (op == "<") left = left < right;
+            else if (op == ">") left = left > right;
+            else if (op == "<=") left = left <= right;
+            else if (op == ">=") left = left >= right;
+            else if (op == "<<") left <<= right;
+            else if (op == ">>") left >>= right;
+            else if (op == "+") left += right;
+            else if (op == "-") left -= right;
+            else if (op == "*") left *= right;
+            else if (right == 0) bad = true;
+            else if (op == "/") left /= right;
+            else left %= right;
+         }
+      }
+
+      long long ternary() {
+         long long cond = binary (1);
+         if (peek() != "?") return cond;
+         ++pos;
+         long long yes = ternary();
+         if (peek() != ":") bad = true;
+         ++pos;
+         long long no = ternary();
+         return cond ? yes : no;
+      }
+   };
+}
+
+bool preprocessor::eval_condition (const string& text) {
+   // Replace defined NAME and defined (NAME) before expanding.
+   string resolved;
+   for (size_t pos = 0; pos < text.size();) {
+      if (not ident_start (text[pos])) {
+         resolved += text[pos++];
+         continue;
+      }
+      size_t end = pos;
+      while (end < text.size() and ident_char (text[end])) ++end;
+      string word = text.substr (pos, end - pos);
+      pos = end;
+      if (word != "defined") {
+         resolved += word;
+         continue;
+      }
+      size_t name = skip_space (text, pos);
+      bool paren = name < text.size() and text[name] == '(';
+      if (paren) name = skip_space (text, name + 1);
+      size_t name_end = name;
+      while (name_end < text.size() and ident_char (text[name_end])) {
+         ++name_end;
+      }
+      pos = paren ? skip_space (text, name_end) + 1 : name_end;
+      resolved += macros.count (text.substr (name, name_end - name))
+                ? " 1 " : " 0 ";
+   }
+   unordered_set<string> disabled;
+   string expanded = expand (resolved, disabled);
+   expr_parser parser;
+   for (size_t pos = 0; pos < expanded.size();) {
+      char chr = expanded[pos];
+      if (isspace (chr)) {
+         ++pos;
+         continue;
+      }
+      size_t end = pos + 1;
+      if (chr == '\'') {
+         end = skip_literal (expanded, pos);
+      }else if (ident_char (chr)) {
+         while (end < expanded.size() and ident_char (expanded[end])) {
+            ++end;
+         }
+      }else if (strchr ("|&=!<>", chr) and end < expanded.size()) {
+         string two = expanded.substr (pos, 2);
+         if (two == "||" or two == "&&" or two == "==" or two == "!="
+             or two == "<=" or two == ">=" or two == "<<"
+             or two == ">>") ++end;
+      }
+      parser.tokens.push_back (expanded.substr (pos, end - pos));
+      pos = end;
+   }
+   long long value = parser.ternary();
+   if (parser.bad or parser.pos != parser.tokens.size()) {
+      error ("invalid #if expression");
+      return false;
+   }
+   return value != 0;
+}
+
+void preprocessor::marker (size_t line, const string& file,
+                           const char* flag) {
+   *out += "# " + to_string (line) + " \"" + file + "\"";
+   if (flag != nullptr) *out += string (" ") + flag;
+   *out += '\n';
+   out_line = line;
+}
+
+// Moves the output to line, with newlines if it is close, as cpp
+// does, or with a line marker otherwise.
+void preprocessor::sync_line (size_t line) {
+   if (line >= out_line and line < out_line + 8) {
+      out->append (line - out_line, '\n');
+      out_line = line;
+   }else {
+      marker (line, cur_file, nullptr);
+   }
+}
+
+void preprocessor::directive (const string& text,
+                              vector<conditional>& conds, int depth) {
+   size_t pos = skip_space (text, text.find ('#') + 1);
+   size_t end = pos;
+   while (end < text.size() and ident_char (text[end])) ++end;
+   string name = text.substr (pos, end - pos);
+   string rest = trim (text.substr (end));
+   bool parent_active = conds.empty() or conds.back().active;
+
+   if (name == "if" or name == "ifdef" or name == "ifndef") {
+      bool value = false;
+      if (parent_active) {
+         if (name == "if") value = eval_condition (rest);
+                      else value = macros.count (rest) == 0
+                                   ? name == "ifndef" : name == "ifdef";
+      }
+      conds.push_back ({value, value or not parent_active, false});
+      return;
+   }
+   if (name == "elif" or name == "else" or name == "endif") {
+      if (conds.empty()) {
+         error ("#" + name + " without #if");
+         return;
+      }
+      conditional& top = conds.back();
+      if (name == "endif") {
+         conds.pop_back();
+         return;
+      }
+      if (top.seen_else) {
+         error ("#" + name + " after #else");
+         return;
+      }
+      bool enclosing = conds.size() < 2 or conds[conds.size() - 2].active;
+      if (name == "else") {
+         top.seen_else = true;
+         top.active = enclosing and not top.taken;
+      }else {
+         top.active = enclosing and not top.taken
+                      and eval_condition (rest);
+      }
+      top.taken = top.taken or top.active;
+      return;
+   }
+   if (not parent_active) return;
+
+   if (name == "define") {
+      define_line (rest);
+   }else if (name == "undef") {
+      macros.erase (rest);
+   }else if (name == "include") {
+      if (rest.size() < 2 or (rest[0] != '"' and rest[0] != '<')) {
+         error ("#include expects \"FILENAME\"");
+         return;
+      }
+      char close = rest[0] == '"' ? '"' : '>';
+      size_t last = rest.find (close, 1);
+      if (last == string::npos) {
+         error ("missing terminating character in #include");
+         return;
+      }
+      string file = rest.substr (1, last - 1);
+      // -nostdinc: only the directory of the including file.
+      string path = file;
+      size_t slash = cur_file.rfind ('/');
+      if (file[0] != '/' and slash != string::npos) {
+         path = cur_file.substr (0, slash + 1) + file;
+      }
+      mapfile contents;
+      const mapfile* text = find_preloaded (path);
+      if (text == nullptr) text = &contents;
+      if (close == '>'
+          or (text == &contents and not contents.open (path))) {
+         error (file + ": No such file or directory");
+         return;
+      }
+      if (depth >= 200) {
+         error ("#include nested depth 200 exceeds maximum");
+         return;
+      }
+      string saved_file = cur_file;
+      size_t saved_line = cur_line;
+      marker (1, path, "1");
+      process (path, {text->data(), text->size()}, depth + 1);
+      cur_file = saved_file;
+      cur_line = saved_line;
+      marker (cur_line + 1, cur_file, "2");
+   }else if (name == "error") {
+      error ("#error " + rest);
+   }else if (name.empty() or name == "pragma" or name == "line"
+             or isdigit (name[0])) {
+      // Null directive, or one cpp would pass on; nothing to do.
+   }else {
+      error ("invalid preprocessing directive #" + name);
+   }
+}
+
+// True if a function-like macro call in text is not closed by the
+// end of it, so it may take its arguments from the next part.
+bool preprocessor::open_macro_call (const string& text) {
+   for (size_t pos = 0; pos < text.size();) {
+      if (text[pos] == '"' or text[pos] == '\'') {
+         pos = skip_literal (text, pos);
+      }else if (ident_start (text[pos])) {
+         size_t end = pos;
+         while (end < text.size() and ident_char (text[end])) ++end;
+         auto found = macros.find (text.substr (pos, end - pos));
+         pos = end;
+         if (found == macros.end() or not found->second.function) {
+            continue;
+         }
+         size_t paren = skip_space (text, pos);
+         if (paren == text.size()) return true;
+         vector<string> args;
+         if (text[paren] == '(' and not collect_args (text, paren, args)) {
+            return true;
+         }
+      }else {
+         ++pos;
+      }
+   }
+   return false;
+}
+
+void preprocessor::emit (const source_part& part, const string& text) {
+   string tokens = normalize (text);
+   if (tokens.empty()) return;
+   unordered_set<string> disabled;
+   string expanded = expand (tokens, disabled);
+   sync_line (part.linenr);
+   out->append (part.indent, ' ');
+   *out += expanded;
+   *out += '\n';
+   ++out_line;
+}
+
+void preprocessor::process (const string& path, const text_view& text,
+                            int depth) {
+   vector<conditional> conds;
+   cur_file = path;
+   vector<source_line> lines = split_lines (text);
+   for (size_t index = 0; index < lines.size(); ++index) {
+      source_line line = lines[index];
+      string joined = line.text();
+      cur_line = line.parts[0].linenr;
+      size_t first = skip_space (joined, 0);
+      if (first < joined.size() and joined[first] == '#') {
+         directive (joined, conds, depth);
+         continue;
+      }
+      if (not conds.empty() and not conds.back().active) continue;
+      // Macro arguments may go on over the following lines.
+      while (open_macro_call (joined) and index + 1 < lines.size()) {
+         string next = lines[index + 1].text();
+         first = skip_space (next, 0);
+         if (first < next.size() and next[first] == '#') break;
+         ++index;
+         joined += " " + next;
+         for (const auto& part: lines[index].parts) {
+            line.parts.push_back (part);
+         }
+      }
+      bool whole = line.parts.size() == 1;
+      for (size_t part = 0; part + 1 < line.parts.size(); ++part) {
+         whole = whole or open_macro_call (line.parts[part].text);
+      }
+      if (whole) {
+         for (const auto& part: line.parts) {
+            if (part.indent == string::npos) continue;
+            cur_line = part.linenr;
+            emit (part, joined);
+            break;
+         }
+      }else {
+         for (const auto& part: line.parts) {
+            cur_line = part.linenr;
+            emit (part, part.text);
+         }
+      }
+   }
+   if (not conds.empty()) error ("unterminated conditional directive");
+}
+
+bool preprocessor::run (const string& filename, string& output) {
+   failed = false;
+   cur_file = filename;
+   cur_line = 0;
+   mapfile text;
+   if (not text.open (filename)) {
+      error (filename + ": No such file or directory");
+      return false;
+   }
+   out = &output;
+   output.clear();
+   for (const char* name: {filename.c_str(), "<built-in>",
+                           "<command-line>"}) {
+      marker (0, name, nullptr);
+   }
+   marker (1, filename, nullptr);
+   process (filename, {text.data(), text.size()}, 0);
+   out = nullptr;
+   return not failed;
+}
+
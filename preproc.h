@@ -0,0 +1,74 @@
+#ifndef __PREPROC_H__
+#define __PREPROC_H__
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+using namespace std;
+
+//
+// DESCRIPTION
+//    In-process replacement for running "cpp -nostdinc" on a source
+//    file.  Handles #include "file", #define and #undef (object-like
+//    and function-like, with # and ##), #if/#ifdef/#ifndef/#elif/
+//    #else/#endif, #error, and -D definitions.  The output follows
+//    cpp's layout: comments and extra whitespace are squeezed to a
+//    single space, line numbers are kept with blank lines or
+//    # linenr "file" markers, so the scanner sees the same text.
+//
+
+struct source_part;
+struct text_view;
+
+struct preprocessor {
+   struct macro {
+      bool function = false;
+      vector<string> params;
+      string body;
+   };
+
+   bool define (const string& option);
+   // Takes the argument of -D: NAME or NAME=VALUE.
+
+   bool run (const string& filename, string& output);
+   // Preprocesses filename into output.  Diagnostics go through
+   // errprintf.  Returns false if there were any errors.
+
+   static bool preload (const string& path);
+   // Keeps path mapped so that every later #include of the same
+   // file reads it from memory, as long as it has not changed on
+   // disk.  Meant for a long-lived process such as oc --server.
+
+   private:
+      struct conditional {
+         bool active;      // lines in this branch are kept
+         bool taken;       // some branch has been taken
+         bool seen_else;
+      };
+      unordered_map<string,macro> macros;
+      string* out = nullptr;
+      size_t out_line = 0;     // source line the output is at
+      bool failed = false;
+      string cur_file;
+      size_t cur_line = 0;
+
+      void define_line (const string& text);
+      void process (const string& path, const text_view& text,
+                    int depth);
+      void directive (const string& line, vector<conditional>& conds,
+                      int depth);
+      bool open_macro_call (const string& text);
+      void emit (const source_part& part, const string& text);
+      void sync_line (size_t line);
+      void marker (size_t line, const string& file, const char* flag);
+      string expand (const string& text,
+                     unordered_set<string>& disabled);
+      string substitute (const macro& mac, const vector<string>& args,
+                         unordered_set<string>& disabled);
+      bool eval_condition (const string& text);
+      void error (const string& message);
+};
+
+#endif
+
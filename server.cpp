@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "auxlib.h"
+#include "server.h"
+
+static string listening_path;
+
+static double elapsed_ms (const struct timespec& start) {
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start.tv_sec) * 1e3
+        + (now.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static bool make_address (const string& path, sockaddr_un& address) {
+   if (path.size() >= sizeof address.sun_path) {
+      errprintf ("%:%s: socket path too long\n", path.c_str());
+      return false;
+   }
+   memset (&address, 0, sizeof address);
+   address.sun_family = AF_UNIX;
+   strcpy (address.sun_path, path.c_str());
+   return true;
+}
+
+static bool write_all (int fd, const string& data) {
+   size_t done = 0;
+   while (done < data.size()) {
+      ssize_t count = write (fd, data.data() + done, data.size() - done);
+      if (count < 0 and errno == EINTR) continue;
+      if (count <= 0) return false;
+      done += count;
+   }
+   return true;
+}
+
+static bool read_all (int fd, string& data) {
+   char buffer[0x1000];
+   for (;;) {
+      ssize_t count = read (fd, buffer, sizeof buffer);
+      if (count < 0 and errno == EINTR) continue;
+      if (count < 0) return false;
+      if (count == 0) return true;
+      data.append (buffer, count);
+   }
+}
+
+static void stop_server (int) {
+   unlink (listening_path.c_str());
+   _exit (EXIT_FAILURE);
+}
+
+// Runs in the child forked for one connection.
+static void serve (int connection, request_handler handler) {
+   struct timespec start;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   string request;
+   if (not read_all (connection, request)) return;
+   vector<string> fields;
+   for (size_t pos = 0; pos < request.size();) {
+      size_t end = request.find ('\0', pos);
+      if (end == string::npos) end = request.size();
+      fields.push_back (request.substr (pos, end - pos));
+      pos = end + 1;
+   }
+   if (fields.empty()) return;
+
+   int log_fd = dup (STDERR_FILENO);
+   FILE* errors = tmpfile();
+   if (errors == nullptr) {
+      syserrprintf ("tmpfile");
+      return;
+   }
+   int status = EXIT_FAILURE;
+   vector<string> outputs;
+   fflush (NULL);
+   dup2 (fileno (errors), STDERR_FILENO);
+   if (chdir (fields[0].c_str()) != 0) {
+      syserrprintf (fields[0].c_str());
+   }else {
+      vector<string> args (fields.begin() + 1, fields.end());
+      status = handler (args, outputs);
+   }
+   fflush (NULL);
+   string diagnostics;
+   rewind (errors);
+   read_all (fileno (errors), diagnostics);
+   fclose (errors);
+
+   string reply = "status " + to_string (status) + "\n";
+   for (const auto& path: outputs) reply += "output " + path + "\n";
+   reply += "diagnostics " + to_string (diagnostics.size()) + "\n";
+   reply += diagnostics;
+   write_all (connection, reply);
+   close (connection);
+
+   string files;
+   for (size_t arg = 1; arg < fields.size(); ++arg) {
+      files += " " + fields[arg];
+   }
+   dprintf (log_fd, "%s: served%s: status %d, %.3f ms\n",
+            exec::execname.c_str(), files.c_str(), status,
+            elapsed_ms (start));
+   close (log_fd);
+}
+
+int run_server (const string& socket_path, request_handler handler) {
+   sockaddr_un address;
+   if (not make_address (socket_path, address)) return EXIT_FAILURE;
+   int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (listener < 0) {
+      syserrprintf ("socket");
+      return EXIT_FAILURE;
+   }
+   unlink (socket_path.c_str());
+   if (bind (listener, reinterpret_cast<sockaddr*> (&address),
+             sizeof address) != 0
+       or listen (listener, SOMAXCONN) != 0) {
+      syserrprintf (socket_path.c_str());
+      close (listener);
+      return EXIT_FAILURE;
+   }
+   listening_path = socket_path;
+   signal (SIGINT, stop_server);
+   signal (SIGTERM, stop_server);
+   eprintf ("%:listening on %s\n", socket_path.c_str());
+   for (;;) {
+      int connection = accept (listener, nullptr, nullptr);
+      while (waitpid (-1, nullptr, WNOHANG) > 0) continue;
+      if (connection < 0) {
+         if (errno == EINTR) continue;
+         syserrprintf ("accept");
+         break;
+      }
+      fflush (NULL);
+      pid_t pid = fork();
+      if (pid == 0) {
+         close (listener);
+         serve (connection, handler);
+         _exit (EXIT_SUCCESS);
+      }
+      if (pid < 0) syserrprintf ("fork");
+      close (connection);
+   }
+   close (listener);
+   unlink (socket_path.c_str());
+   return EXIT_FAILURE;
+}
+
+int run_client (const string& socket_path, const vector<string>& args) {
+   struct timespec start;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   sockaddr_un address;
+   if (not make_address (socket_path, address)) return EXIT_FAILURE;
+   char cwd[PATH_MAX];
+   if (getcwd (cwd, sizeof cwd) == nullptr) {
+      syserrprintf ("getcwd");
+      return EXIT_FAILURE;
+   }
+   int server = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (server < 0) {
+      syserrprintf ("socket");
+      return EXIT_FAILURE;
+   }
+   if (connect (server, reinterpret_cast<sockaddr*> (&address),
+                sizeof address) != 0) {
+      syserrprintf (socket_path.c_str());
+      close (server);
+      return EXIT_FAILURE;
+   }
+   string request = cwd;
+   request += '\0';
+   for (const auto& arg: args) {
+      request += arg;
+      request += '\0';
+   }
+   string reply;
+   bool sent = write_all (server, request)
+               and shutdown (server, SHUT_WR) == 0;
+   bool received = sent and read_all (server, reply);
+   close (server);
+   if (not received) {
+      syserrprintf (socket_path.c_str());
+      return EXIT_FAILURE;
+   }
+
+   int status = EXIT_FAILURE;
+   bool complete = false;
+   vector<string> outputs;
+   for (size_t pos = 0; pos < reply.size();) {
+      size_t end = reply.find ('\n', pos);
+      if (end == string::npos) break;
+      string line = reply.substr (pos, end - pos);
+      pos = end + 1;
+      if (line.compare (0, 7, "status ") == 0) {
+         status = atoi (line.c_str() + 7);
+      }else if (line.compare (0, 7, "output ") == 0) {
+         outputs.push_back (line.substr (7));
+      }else if (line.compare (0, 12, "diagnostics ") == 0) {
+         size_t length = strtoul (line.c_str() + 12, nullptr, 10);
+         if (pos + length != reply.size()) break;
+         fwrite (reply.data() + pos, 1, length, stderr);
+         complete = true;
+         break;
+      }
+   }
+   if (not complete) {
+      errprintf ("%:%s: incomplete reply from server\n",
+                 socket_path.c_str());
+      return EXIT_FAILURE;
+   }
+   for (const auto& path: outputs) printf ("%s\n", path.c_str());
+   printf ("latency %.3f ms\n", elapsed_ms (start));
+   return status;
+}
+
@@ -0,0 +1,38 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+#include <vector>
+using namespace std;
+
+//
+// DESCRIPTION
+//    Compile server over a local Unix domain socket.  A client sends
+//    its working directory and its command line arguments, and gets
+//    back the exit status, the output files written and the
+//    diagnostics.  Each request is served by a child forked from the
+//    server, so it starts from the server's warm state and leaves
+//    nothing behind.
+//
+//    Request:  cwd NUL arg NUL arg NUL ... then end of file.
+//    Reply:    "status N\n", one "output PATH\n" per file written,
+//              "diagnostics LENGTH\n", then LENGTH bytes of stderr.
+//
+
+using request_handler = int (*) (const vector<string>& args,
+                                 vector<string>& outputs);
+// Runs one request in the server's child, with its working directory
+// already set and stderr captured.  Fills outputs with the paths it
+// wrote and returns the exit status.
+
+int run_server (const string& socket_path, request_handler handler);
+// Serves requests until killed.  Logs each request and its latency
+// to stderr.
+
+int run_client (const string& socket_path, const vector<string>& args);
+// Sends one request, copies the diagnostics to stderr, prints the
+// output paths and the request latency to stdout, and returns the
+// status from the server.
+
+#endif
+
@@ -0,0 +1,751 @@
+#include <limits.h>
+#include <algorithm>
+
+#include "ssa.h"
+
+//
+// DESCRIPTION
+//    ir_function::optimize, and the passes into, over and out of SSA
+//    form; common subexpressions are reused in cse.cpp, loop-invariant
+//    code hoisted in licm.cpp and dead code removed in dce.cpp.  Local
+//    variables and parameters are put in SSA form: each assignment
+//    sets a new vreg, and where the values of a variable from two
+//    paths meet, at the head of a while loop or after an if, a phi
+//    picks between them.
+//    Sparse conditional constant propagation then runs over the whole
+//    function, following only the branches that can be taken, so it
+//    finds constants that flow through loops and ifs and the code no
+//    path reaches.  Last, each phi becomes copies at the ends of the
+//    blocks it comes from.
+//
+
+static const uint32_t no_block = ir_function::no_block;
+
+void flow_graph::build (const ir_function& fn) {
+   uint32_t blocks = fn.blocks.size();
+   static thread_local vector<pair<uint32_t, int>> stack;
+   rank.assign (blocks, no_block);
+   order.clear();
+   stack.clear();
+   stack.push_back ({0, 0});
+   rank[0] = 0;
+   while (not stack.empty()) {
+      uint32_t nr = stack.back().first;
+      uint32_t next[2];
+      int count = fn.successors (nr, next);
+      if (stack.back().second < count) {
+         uint32_t succ = next[stack.back().second++];
+         if (rank[succ] == no_block) {
+            rank[succ] = 0;
+            stack.push_back ({succ, 0});
+         }
+      }else {
+         order.push_back (nr);
+         stack.pop_back();
+      }
+   }
+   reverse (order.begin(), order.end());
+   for (uint32_t place = 0; place < order.size(); ++place) {
+      rank[order[place]] = place;
+   }
+
+   pred_first.assign (blocks + 1, 0);
+   for (uint32_t nr: order) {
+      uint32_t next[2];
+      int count = fn.successors (nr, next);
+      for (int succ = 0; succ < count; ++succ) ++pred_first[next[succ] + 1];
+   }
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      pred_first[nr + 1] += pred_first[nr];
+   }
+   preds.resize (pred_first[blocks]);
+   static thread_local vector<uint32_t> fill;
+   fill.assign (pred_first.begin(), pred_first.end() - 1);
+   for (uint32_t nr: order) {
+      uint32_t next[2];
+      int count = fn.successors (nr, next);
+      for (int succ = 0; succ < count; ++succ) {
+         preds[fill[next[succ]]++] = nr;
+      }
+   }
+
+   idom.assign (blocks, no_block);
+   idom[0] = 0;
+   for (bool changed = true; changed;) {
+      changed = false;
+      for (uint32_t place = 1; place < order.size(); ++place) {
+         uint32_t nr = order[place];
+         uint32_t dom = no_block;
+         for (uint32_t pred = pred_first[nr]; pred < pred_first[nr + 1];
+              ++pred) {
+            uint32_t from = preds[pred];
+            if (idom[from] == no_block) continue;
+            dom = dom == no_block ? from : intersect (from, dom);
+         }
+         if (idom[nr] != dom) {
+            idom[nr] = dom;
+            changed = true;
+         }
+      }
+   }
+}
+
+//
+// SSA construction, after Cytron et al.  Phis are placed on the
+// iterated dominance frontiers of the blocks that set a variable, but
+// only for variables read in some block before it sets them, so a
+// variable declared and used inside one block gets none.  Renaming
+// then walks the dominator tree with an explicit stack.
+//
+
+void build_ssa (ir_function& fn, const flow_graph& graph) {
+   uint32_t blocks = fn.blocks.size();
+   uint32_t vars = fn.vars.size();
+   static thread_local vector<vector<uint32_t>> frontier;
+   if (frontier.size() < blocks) frontier.resize (blocks);
+   for (uint32_t nr = 0; nr < blocks; ++nr) frontier[nr].clear();
+   for (uint32_t nr: graph.order) {
+      uint32_t first = graph.pred_first[nr];
+      uint32_t last = graph.pred_first[nr + 1];
+      if (last - first < 2) continue;
+      for (uint32_t pred = first; pred < last; ++pred) {
+         for (uint32_t runner = graph.preds[pred];
+              runner != graph.idom[nr]; runner = graph.idom[runner]) {
+            if (frontier[runner].empty() or frontier[runner].back() != nr) {
+               frontier[runner].push_back (nr);
+            }
+         }
+      }
+   }
+
+   static thread_local vector<vector<uint32_t>> def_blocks;
+   static thread_local vector<uint32_t> last_set;
+   static thread_local vector<bool> read_first;
+   if (def_blocks.size() < vars) def_blocks.resize (vars);
+   last_set.assign (vars, no_block);
+   read_first.assign (vars, false);
+   for (uint32_t var = 0; var < vars; ++var) {
+      def_blocks[var].clear();
+      if (fn.vars[var].param) def_blocks[var].push_back (0);
+   }
+   for (uint32_t nr: graph.order) {
+      for (const ir_instr& instr: fn.blocks[nr].code) {
+         for_each_use (fn, instr, [&] (const ir_value& value) {
+            if (value.what == ir_value::VAR and fn.vars[value.index].local
+                and last_set[value.index] != nr) {
+               read_first[value.index] = true;
+            }
+         });
+         if (instr.dest.what != ir_value::VAR
+             or not fn.vars[instr.dest.index].local) continue;
+         uint32_t var = instr.dest.index;
+         if (last_set[var] != nr) def_blocks[var].push_back (nr);
+         last_set[var] = nr;
+      }
+   }
+
+   static thread_local vector<vector<ir_instr>> phis;
+   static thread_local vector<uint32_t> has_phi, queued, work;
+   if (phis.size() < blocks) phis.resize (blocks);
+   for (uint32_t nr = 0; nr < blocks; ++nr) phis[nr].clear();
+   has_phi.assign (blocks, no_block);
+   queued.assign (blocks, no_block);
+   for (uint32_t var = 0; var < vars; ++var) {
+      if (not read_first[var]) continue;
+      work = def_blocks[var];
+      for (uint32_t nr: work) queued[nr] = var;
+      while (not work.empty()) {
+         uint32_t nr = work.back();
+         work.pop_back();
+         for (uint32_t join: frontier[nr]) {
+            if (has_phi[join] == var) continue;
+            has_phi[join] = var;
+            ir_instr phi;
+            phi.op = ir_instr::PHI;
+            phi.type = fn.vars[var].kind;
+            phi.ctype = fn.vars[var].ctype;
+            phi.dest = ir_value::vreg (++fn.vregs);
+            phi.a = phi.b = ir_value::none();
+            phi.c = ir_value::var (var);
+            phi.aux[0] = fn.args.size();
+            phi.aux[1] = graph.pred_first[join + 1] - graph.pred_first[join];
+            phi.layout = nullptr;
+            for (uint32_t pred = graph.pred_first[join];
+                 pred < graph.pred_first[join + 1]; ++pred) {
+               fn.args.push_back (ir_value::none());
+               fn.args.push_back (ir_value::constant (graph.preds[pred]));
+            }
+            phis[join].push_back (phi);
+            if (queued[join] != var) {
+               queued[join] = var;
+               work.push_back (join);
+            }
+         }
+      }
+   }
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      if (phis[nr].empty()) continue;
+      vector<ir_instr>& code = fn.blocks[nr].code;
+      code.insert (code.begin(), phis[nr].begin(), phis[nr].end());
+   }
+
+   // The vregs the variables hold, innermost last.  A variable read
+   // before anything set it reads 0.
+   static thread_local vector<vector<ir_value>> current;
+   static thread_local vector<uint32_t> pushed;
+   static thread_local vector<ir_instr> entry;
+   if (current.size() < vars) current.resize (vars);
+   for (uint32_t var = 0; var < vars; ++var) current[var].clear();
+   pushed.clear();
+   entry.clear();
+   for (uint32_t var = 0; var < vars; ++var) {
+      if (not fn.vars[var].param) continue;
+      ir_instr copy;
+      copy.op = ir_instr::COPY;
+      copy.type = fn.vars[var].kind;
+      copy.ctype = fn.vars[var].ctype;
+      copy.dest = ir_value::vreg (++fn.vregs);
+      copy.a = ir_value::var (var);
+      copy.b = copy.c = ir_value::none();
+      copy.aux[0] = copy.aux[1] = 0;
+      copy.layout = nullptr;
+      entry.push_back (copy);
+      current[var].push_back (copy.dest);
+   }
+   auto top = [&] (uint32_t var) {
+      return current[var].empty() ? ir_value::none()
+                                  : current[var].back();
+   };
+
+   static thread_local vector<uint32_t> child_first, children;
+   child_first.assign (blocks + 1, 0);
+   for (uint32_t nr: graph.order) {
+      if (nr != 0) ++child_first[graph.idom[nr] + 1];
+   }
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      child_first[nr + 1] += child_first[nr];
+   }
+   children.resize (child_first[blocks]);
+   static thread_local vector<uint32_t> fill;
+   fill.assign (child_first.begin(), child_first.end() - 1);
+   for (uint32_t nr: graph.order) {
+      if (nr != 0) children[fill[graph.idom[nr]]++] = nr;
+   }
+
+   struct rename_frame { uint32_t block, child; size_t mark; };
+   static thread_local vector<rename_frame> stack;
+   stack.clear();
+   stack.push_back ({0, child_first[0], 0});
+   for (bool enter = true; not stack.empty();) {
+      rename_frame& frame = stack.back();
+      uint32_t nr = frame.block;
+      if (enter) {
+         frame.mark = pushed.size();
+         for (ir_instr& instr: fn.blocks[nr].code) {
+            if (instr.op == ir_instr::PHI) {
+               current[instr.c.index].push_back (instr.dest);
+               pushed.push_back (instr.c.index);
+               continue;
+            }
+            for_each_use (fn, instr, [&] (ir_value& value) {
+               if (value.what != ir_value::VAR
+                   or not fn.vars[value.index].local) return;
+               value = top (value.index);
+               if (value.what == ir_value::NONE) {
+                  value = ir_value::constant (0);
+               }
+            });
+            if (instr.dest.what == ir_value::VAR
+                and fn.vars[instr.dest.index].local) {
+               uint32_t var = instr.dest.index;
+               instr.type = fn.vars[var].kind;
+               instr.ctype = fn.vars[var].ctype;
+               instr.dest = ir_value::vreg (++fn.vregs);
+               current[var].push_back (instr.dest);
+               pushed.push_back (var);
+            }
+         }
+         uint32_t next[2];
+         int count = fn.successors (nr, next);
+         for (int succ = 0; succ < count; ++succ) {
+            for (ir_instr& phi: fn.blocks[next[succ]].code) {
+               if (phi.op != ir_instr::PHI) break;
+               for (uint32_t pair = 0; pair < phi.aux[1]; ++pair) {
+                  ir_value* operand = &fn.args[phi.aux[0] + 2 * pair];
+                  if (uint32_t (operand[1].number) == nr) {
+                     operand[0] = top (phi.c.index);
+                  }
+               }
+            }
+         }
+      }
+      if (frame.child < child_first[nr + 1]) {
+         uint32_t child = children[frame.child++];
+         stack.push_back ({child, child_first[child], 0});
+         enter = true;
+         continue;
+      }
+      for (size_t undo = pushed.size(); undo > frame.mark; --undo) {
+         current[pushed[undo - 1]].pop_back();
+      }
+      pushed.resize (frame.mark);
+      stack.pop_back();
+      enter = false;
+   }
+   vector<ir_instr>& code = fn.blocks[0].code;
+   code.insert (code.begin(), entry.begin(), entry.end());
+
+   // A variable read in a block other than the one that set it, but
+   // dead where the paths meet, got a phi nothing reads.  Phis only
+   // kept alive by other phis go too.
+   static thread_local vector<const ir_instr*> phi_of;
+   static thread_local vector<bool> live;
+   phi_of.assign (fn.vregs + 1, nullptr);
+   live.assign (fn.vregs + 1, false);
+   work.clear();
+   for (uint32_t nr: graph.order) {
+      for (const ir_instr& instr: fn.blocks[nr].code) {
+         if (instr.op == ir_instr::PHI) {
+            phi_of[instr.dest.index] = &instr;
+            continue;
+         }
+         for_each_use (fn, instr, [&] (const ir_value& value) {
+            if (value.what != ir_value::VREG or live[value.index]) return;
+            live[value.index] = true;
+            work.push_back (value.index);
+         });
+      }
+   }
+   while (not work.empty()) {
+      const ir_instr* phi = phi_of[work.back()];
+      work.pop_back();
+      if (phi == nullptr) continue;
+      for_each_use (fn, *phi, [&] (const ir_value& value) {
+         if (value.what != ir_value::VREG or live[value.index]) return;
+         live[value.index] = true;
+         work.push_back (value.index);
+      });
+   }
+   for (uint32_t nr: graph.order) {
+      vector<ir_instr>& code = fn.blocks[nr].code;
+      code.erase (remove_if (code.begin(), code.end(),
+                             [&] (const ir_instr& instr) {
+                                return instr.op == ir_instr::PHI
+                                       and not live[instr.dest.index];
+                             }),
+                  code.end());
+      for (ir_instr& instr: code) {
+         if (instr.op != ir_instr::PHI) break;
+         instr.c = ir_value::none();
+      }
+   }
+}
+
+//
+// Sparse conditional constant propagation, after Wegman and Zadeck.
+// A vreg is unknown until some instruction that can run sets it, then
+// a constant, then varying; a block is only looked at once an edge
+// into it can be taken.  Arithmetic folds as on a 32-bit int that
+// wraps, and a division that would trap is left to run.
+//
+
+namespace {
+struct lattice {
+   enum state : uint8_t { UNKNOWN, CONSTANT, VARYING };
+   state what;
+   int32_t number;
+   static lattice meet (lattice x, lattice y) {
+      if (x.what == UNKNOWN) return y;
+      if (y.what == UNKNOWN) return x;
+      if (x.what == CONSTANT and y.what == CONSTANT
+          and x.number == y.number) return x;
+      return {VARYING, 0};
+   }
+};
+}
+
+static bool fold (ir_instr::opcode op, int32_t a, int32_t b,
+                  int32_t& result) {
+   uint32_t ua = a;
+   uint32_t ub = b;
+   switch (op) {
+      case ir_instr::COPY: result = a; break;
+      case ir_instr::ADD:  result = int32_t (ua + ub); break;
+      case ir_instr::SUB:  result = int32_t (ua - ub); break;
+      case ir_instr::MUL:  result = int32_t (ua * ub); break;
+      case ir_instr::DIV:
+      case ir_instr::REM:
+         if (b == 0 or (a == INT_MIN and b == -1)) return false;
+         result = op == ir_instr::DIV ? a / b : a % b;
+         break;
+      case ir_instr::LT:   result = a < b; break;
+      case ir_instr::LE:   result = a <= b; break;
+      case ir_instr::GT:   result = a > b; break;
+      case ir_instr::GE:   result = a >= b; break;
+      case ir_instr::EQ:   result = a == b; break;
+      case ir_instr::NE:   result = a != b; break;
+      case ir_instr::NEG:  result = int32_t (0u - ua); break;
+      case ir_instr::NOT:  result = not a; break;
+      default:             return false;
+   }
+   return true;
+}
+
+void propagate_constants (ir_function& fn) {
+   uint32_t blocks = fn.blocks.size();
+   uint32_t vregs = fn.vregs + 1;
+   static thread_local vector<lattice> values;
+   static thread_local vector<vreg_kind> kinds;
+   static thread_local vector<uint32_t> use_first, use_block, use_instr;
+   values.assign (vregs, {lattice::UNKNOWN, 0});
+   kinds.assign (vregs, VREG_INT);
+   use_first.assign (vregs + 1, 0);
+   for (const ir_block& block: fn.blocks) {
+      for (const ir_instr& instr: block.code) {
+         for_each_use (fn, instr, [&] (const ir_value& value) {
+            if (value.what == ir_value::VREG) ++use_first[value.index + 1];
+         });
+         if (instr.dest.what == ir_value::VREG) {
+            kinds[instr.dest.index] = instr.type;
+         }
+      }
+   }
+   for (uint32_t vreg = 0; vreg < vregs; ++vreg) {
+      use_first[vreg + 1] += use_first[vreg];
+   }
+   use_block.resize (use_first[vregs]);
+   use_instr.resize (use_first[vregs]);
+   static thread_local vector<uint32_t> fill;
+   fill.assign (use_first.begin(), use_first.end() - 1);
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      const vector<ir_instr>& code = fn.blocks[nr].code;
+      for (uint32_t index = 0; index < code.size(); ++index) {
+         for_each_use (fn, code[index], [&] (const ir_value& value) {
+            if (value.what != ir_value::VREG) return;
+            uint32_t slot = fill[value.index]++;
+            use_block[slot] = nr;
+            use_instr[slot] = index;
+         });
+      }
+   }
+
+   // Bit n of taken[b] is set once the edge to b's nth successor can
+   // be taken.
+   static thread_local vector<uint8_t> taken;
+   static thread_local vector<bool> reached;
+   static thread_local vector<pair<uint32_t, int>> flow_work;
+   static thread_local vector<uint32_t> ssa_work;
+   taken.assign (blocks, 0);
+   reached.assign (blocks, false);
+   flow_work.clear();
+   ssa_work.clear();
+
+   auto value_of = [&] (const ir_value& value) -> lattice {
+      switch (value.what) {
+         case ir_value::NONE:  return {lattice::UNKNOWN, 0};
+         case ir_value::CONST: return {lattice::CONSTANT, value.number};
+         case ir_value::VREG:  return values[value.index];
+         default:              return {lattice::VARYING, 0};
+      }
+   };
+   auto edge_taken = [&] (uint32_t from, uint32_t to) {
+      uint32_t next[2];
+      int count = fn.successors (from, next);
+      for (int succ = 0; succ < count; ++succ) {
+         if (next[succ] == to and taken[from] >> succ & 1) return true;
+      }
+      return false;
+   };
+   auto visit = [&] (uint32_t nr, const ir_instr& instr) {
+      lattice result {lattice::VARYING, 0};
+      switch (instr.op) {
+         case ir_instr::JUMP:
+            flow_work.push_back ({nr, 0});
+            return;
+         case ir_instr::BRANCH: {
+            lattice cond = value_of (instr.a);
+            if (cond.what == lattice::UNKNOWN) return;
+            if (cond.what == lattice::VARYING or cond.number != 0) {
+               flow_work.push_back ({nr, 0});
+            }
+            if (cond.what == lattice::VARYING or cond.number == 0) {
+               flow_work.push_back ({nr, 1});
+            }
+            return;
+         }
+         case ir_instr::PHI:
+            result = {lattice::UNKNOWN, 0};
+            for (uint32_t pair = 0; pair < instr.aux[1]; ++pair) {
+               const ir_value* operand = &fn.args[instr.aux[0] + 2 * pair];
+               if (edge_taken (operand[1].number, nr)) {
+                  result = lattice::meet (result, value_of (operand[0]));
+               }
+            }
+            break;
+         case ir_instr::COPY:
+         case ir_instr::ADD: case ir_instr::SUB: case ir_instr::MUL:
+         case ir_instr::DIV: case ir_instr::REM:
+         case ir_instr::LT: case ir_instr::LE: case ir_instr::GT:
+         case ir_instr::GE: case ir_instr::EQ: case ir_instr::NE:
+         case ir_instr::NEG: case ir_instr::NOT: {
+            lattice a = value_of (instr.a);
+            lattice b = instr.op == ir_instr::COPY
+                        or instr.op == ir_instr::NEG
+                        or instr.op == ir_instr::NOT
+                      ? lattice {lattice::CONSTANT, 0} : value_of (instr.b);
+            if (a.what == lattice::VARYING or b.what == lattice::VARYING) {
+               break;
+            }
+            if (a.what == lattice::UNKNOWN or b.what == lattice::UNKNOWN) {
+               result = {lattice::UNKNOWN, 0};
+               break;
+            }
+            result.what = lattice::CONSTANT;
+            if (not fold (instr.op, a.number, b.number, result.number)) {
+               result = {lattice::VARYING, 0};
+            }
+            break;
+         }
+         default:
+            break;
+      }
+      if (instr.dest.what != ir_value::VREG) return;
+      lattice& old = values[instr.dest.index];
+      lattice now = lattice::meet (old, result);
+      if (now.what != old.what or now.number != old.number) {
+         old = now;
+         ssa_work.push_back (instr.dest.index);
+      }
+   };
+   auto visit_block = [&] (uint32_t nr) {
+      const vector<ir_instr>& code = fn.blocks[nr].code;
+      for (const ir_instr& instr: code) visit (nr, instr);
+      if ((code.empty() or not code.back().is_terminator())
+          and nr + 1 < blocks) flow_work.push_back ({nr, 0});
+   };
+
+   reached[0] = true;
+   visit_block (0);
+   while (not flow_work.empty() or not ssa_work.empty()) {
+      while (not flow_work.empty()) {
+         uint32_t from = flow_work.back().first;
+         int succ = flow_work.back().second;
+         flow_work.pop_back();
+         if (taken[from] >> succ & 1) continue;
+         taken[from] |= 1 << succ;
+         uint32_t next[2];
+         fn.successors (from, next);
+         uint32_t to = next[succ];
+         if (not reached[to]) {
+            reached[to] = true;
+            visit_block (to);
+            continue;
+         }
+         for (const ir_instr& instr: fn.blocks[to].code) {
+            if (instr.op != ir_instr::PHI) break;
+            visit (to, instr);
+         }
+      }
+      if (ssa_work.empty()) continue;
+      uint32_t vreg = ssa_work.back();
+      ssa_work.pop_back();
+      for (uint32_t use = use_first[vreg]; use < use_first[vreg + 1]; ++use) {
+         if (reached[use_block[use]]) {
+            visit (use_block[use], fn.blocks[use_block[use]].code[use_instr[use]]);
+         }
+      }
+   }
+
+   // Constant ints replace the vregs that held them.  Constant
+   // pointers, which can only be null, stay in their vregs, since C
+   // cannot take a field or index of a bare 0.
+   auto constant = [&] (uint32_t vreg) {
+      return values[vreg].what == lattice::CONSTANT
+             and kinds[vreg] == VREG_INT;
+   };
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      vector<ir_instr>& code = fn.blocks[nr].code;
+      if (not reached[nr]) {
+         if (not code.empty()) {
+            ++fn.removed.unreachable;
+            fn.removed.unreachable_code += code.size();
+         }
+         code.clear();
+         continue;
+      }
+      for (ir_instr& instr: code) {
+         if (instr.op == ir_instr::PHI) {
+            for (uint32_t pair = 0; pair < instr.aux[1]; ++pair) {
+               ir_value* operand = &fn.args[instr.aux[0] + 2 * pair];
+               if (not edge_taken (operand[1].number, nr)) {
+                  operand[0] = ir_value::none();
+               }
+            }
+         }
+         if (instr.op == ir_instr::BRANCH) {
+            lattice cond = value_of (instr.a);
+            if (cond.what == lattice::CONSTANT) {
+               instr.op = ir_instr::JUMP;
+               instr.aux[0] = instr.aux[cond.number != 0 ? 0 : 1];
+               instr.a = ir_value::none();
+               taken[nr] = 1;
+               ++fn.removed.branches;
+            }
+         }
+         for_each_use (fn, instr, [&] (ir_value& value) {
+            if (value.what == ir_value::VREG and constant (value.index)) {
+               value = ir_value::constant (values[value.index].number);
+            }
+         });
+      }
+      code.erase (remove_if (code.begin(), code.end(),
+                             [&] (const ir_instr& instr) {
+                                return instr.dest.what == ir_value::VREG
+                                       and constant (instr.dest.index);
+                             }),
+                  code.end());
+   }
+}
+
+//
+// Out of SSA.  Every phi gets a fresh vreg that the blocks it comes
+// from copy their value into, and the phi itself becomes a copy from
+// that vreg, so phis that read each other, or a value still needed
+// after the copy, come out right.  Where the block a value comes from
+// branches elsewhere too, the copy goes in a new block on that edge,
+// placed just before the phi's block.
+//
+
+void leave_ssa (ir_function& fn) {
+   uint32_t blocks = fn.blocks.size();
+   static thread_local vector<uint32_t> split_target;
+   static thread_local vector<pair<uint32_t, uint32_t>> splits;
+   split_target.clear();
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      if (fn.blocks[nr].code.empty()
+          or fn.blocks[nr].code[0].op != ir_instr::PHI) continue;
+      splits.clear();  // pred, the block made on its edge to nr
+      for (size_t index = 0; index < fn.blocks[nr].code.size()
+           and fn.blocks[nr].code[index].op == ir_instr::PHI; ++index) {
+         ir_instr phi = fn.blocks[nr].code[index];
+         ir_value temp = ir_value::vreg (++fn.vregs);
+         for (uint32_t input = 0; input < phi.aux[1]; ++input) {
+            ir_value value = fn.args[phi.aux[0] + 2 * input];
+            uint32_t from = fn.args[phi.aux[0] + 2 * input + 1].number;
+            if (value.what == ir_value::NONE) continue;
+            vector<ir_instr>& from_code = fn.blocks[from].code;
+            if (not from_code.empty()
+                and from_code.back().op == ir_instr::BRANCH
+                and from_code.back().aux[0] != from_code.back().aux[1]) {
+               ir_instr& last = from_code.back();
+               auto split = find_if (splits.begin(), splits.end(),
+                     [&] (const pair<uint32_t, uint32_t>& edge) {
+                        return edge.first == from;
+                     });
+               if (split == splits.end()) {
+                  uint32_t edge = fn.blocks.size();
+                  for (uint32_t& target: last.aux) {
+                     if (target == nr) target = edge;
+                  }
+                  ir_instr jump = phi;
+                  jump.op = ir_instr::JUMP;
+                  jump.dest = ir_value::none();
+                  jump.aux[0] = nr;
+                  jump.aux[1] = 0;
+                  fn.blocks.push_back ({{jump}, nullptr,
+                                        fn.blocks[nr].lloc});
+                  split_target.push_back (nr);
+                  splits.push_back ({from, edge});
+                  from = edge;
+               }else {
+                  from = split->second;
+               }
+            }
+            ir_instr copy = phi;
+            copy.op = ir_instr::COPY;
+            copy.dest = temp;
+            copy.a = value;
+            copy.aux[0] = copy.aux[1] = 0;
+            vector<ir_instr>& code = fn.blocks[from].code;
+            if (not code.empty() and code.back().is_terminator()) {
+               code.insert (code.end() - 1, copy);
+            }else {
+               code.push_back (copy);
+            }
+         }
+         ir_instr& copy = fn.blocks[nr].code[index];
+         copy.op = ir_instr::COPY;
+         copy.a = temp;
+         copy.aux[0] = copy.aux[1] = 0;
+      }
+   }
+   if (not split_target.empty()) place_blocks (fn, blocks, split_target);
+}
+
+//
+// The blocks a pass added after the first blocks go each in front of
+// the one before names for it, where it falls into that block in the
+// C without a goto.  Jumps and phis are renumbered to match.
+//
+
+void place_blocks (ir_function& fn, uint32_t blocks,
+                   const vector<uint32_t>& before) {
+   static thread_local vector<uint32_t> order, place;
+   order.clear();
+   place.assign (fn.blocks.size(), 0);
+   static thread_local vector<uint32_t> added_first, added_blocks;
+   added_first.assign (blocks + 1, 0);
+   for (uint32_t target: before) ++added_first[target + 1];
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      added_first[nr + 1] += added_first[nr];
+   }
+   added_blocks.resize (before.size());
+   static thread_local vector<uint32_t> fill;
+   fill.assign (added_first.begin(), added_first.end() - 1);
+   for (uint32_t added = 0; added < before.size(); ++added) {
+      added_blocks[fill[before[added]]++] = blocks + added;
+   }
+   for (uint32_t nr = 0; nr < blocks; ++nr) {
+      for (uint32_t added = added_first[nr]; added < added_first[nr + 1];
+           ++added) {
+         place[added_blocks[added]] = order.size();
+         order.push_back (added_blocks[added]);
+      }
+      place[nr] = order.size();
+      order.push_back (nr);
+   }
+   static thread_local vector<ir_block> reordered;
+   reordered.clear();
+   for (uint32_t nr: order) reordered.push_back (move (fn.blocks[nr]));
+   fn.blocks.swap (reordered);
+   for (ir_block& block: fn.blocks) {
+      for (ir_instr& instr: block.code) {
+         if (instr.op != ir_instr::PHI) break;
+         for (uint32_t input = 0; input < instr.aux[1]; ++input) {
+            int32_t& from = fn.args[instr.aux[0] + 2 * input + 1].number;
+            from = place[from];
+         }
+      }
+      if (block.code.empty()) continue;
+      ir_instr& last = block.code.back();
+      if (last.op == ir_instr::JUMP) {
+         last.aux[0] = place[last.aux[0]];
+      }else if (last.op == ir_instr::BRANCH) {
+         last.aux[0] = place[last.aux[0]];
+         last.aux[1] = place[last.aux[1]];
+      }
+   }
+}
+
+void ir_function::optimize() {
+   static thread_local flow_graph graph;
+   graph.build (*this);
+   build_ssa (*this, graph);
+   propagate_constants (*this);
+   eliminate_common (*this);
+   graph.build (*this);
+   hoist_invariants (*this, graph);
+   remove_dead_code (*this);
+   leave_ssa (*this);
+   simplify_blocks (*this);
+}
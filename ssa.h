@@ -0,0 +1,49 @@
+#ifndef __SSA_H__
+#define __SSA_H__
+
+#include "ir.h"
+
+//
+// DESCRIPTION
+//    The passes ir_function::optimize runs, in that order, and the
+//    control flow facts they share.  Passes between build_ssa and
+//    leave_ssa see the function in SSA form: each vreg is set once,
+//    and phis sit at the top of their blocks.
+//
+
+struct flow_graph {
+   vector<uint32_t> order;       // reachable blocks, reverse postorder
+   vector<uint32_t> rank;        // place in order, no_block if unreachable
+   vector<uint32_t> pred_first;  // the preds of b are preds[pred_first[b]]
+   vector<uint32_t> preds;       // up to preds[pred_first[b + 1]]
+   vector<uint32_t> idom;
+
+   void build (const ir_function& fn);
+   // Finds the immediate dominators by Cooper, Harvey and Kennedy's
+   // iterative algorithm.
+   bool reachable (uint32_t block) const {
+      return rank[block] != ir_function::no_block;
+   }
+   uint32_t intersect (uint32_t a, uint32_t b) const {
+      while (a != b) {
+         while (rank[a] > rank[b]) a = idom[a];
+         while (rank[b] > rank[a]) b = idom[b];
+      }
+      return a;
+   }
+};
+
+void build_ssa (ir_function& fn, const flow_graph& graph);
+void propagate_constants (ir_function& fn);
+void eliminate_common (ir_function& fn);
+void hoist_invariants (ir_function& fn, const flow_graph& graph);
+void remove_dead_code (ir_function& fn);
+void leave_ssa (ir_function& fn);
+void simplify_blocks (ir_function& fn);
+
+void place_blocks (ir_function& fn, uint32_t blocks,
+                   const vector<uint32_t>& before);
+// For passes that add blocks: moves fn.blocks[blocks + n] in front of
+// fn.blocks[before[n]], and renumbers jumps and phis to match.
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <new>
+
+#include "stats.h"
+
+bool stats::enabled = false;
+stats::format stats::output = stats::TEXT;
+uint64_t stats::counts[COUNTERS];
+double stats::seconds[PHASES];
+uint64_t stats::phase_allocations[PHASES];
+atomic<uint64_t> stats::allocations {0};
+uint64_t stats::symbol_counts[SYMBOL_KINDS];
+uint64_t stats::symbol_bytes[SYMBOL_KINDS];
+
+static const char* const phase_names[stats::PHASES] = {
+   "preprocess", "cache", "parse", "semantic", "ast", "oil", "str",
+   "release",
+};
+static const char* const counter_names[stats::COUNTERS] = {
+   "tokens", "nodes", "symbols", "strings", "folds", "vregs",
+   "oil_lines",
+};
+static const char* const symbol_kind_names[stats::SYMBOL_KINDS] = {
+   "function", "param", "field", "variable", "struct", "other", "links",
+};
+
+void stats::timer::begin() {
+   start_allocations = allocations.load (memory_order_relaxed);
+   start = chrono::steady_clock::now();
+}
+
+void stats::timer::end() {
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+   seconds[which] += elapsed.count();
+   phase_allocations[which] += allocations.load (memory_order_relaxed)
+                             - start_allocations;
+}
+
+void stats::print (FILE* outfile, const char* filename) {
+   double total = 0;
+   for (int phase = 0; phase < PHASES; ++phase) total += seconds[phase];
+   if (output == JSON) {
+      // One line, so it can be picked out of the rest of stderr.
+      fprintf (outfile, "{\"oc_stats\": {\"file\": \"%s\", \"phases\": {",
+               filename);
+      for (int phase = 0; phase < PHASES; ++phase) {
+         fprintf (outfile, "%s\"%s\": {\"seconds\": %.6f,"
+                  " \"allocations\": %llu}", phase ? ", " : "",
+                  phase_names[phase], seconds[phase],
+                  static_cast<unsigned long long> (
+                        phase_allocations[phase]));
+      }
+      fprintf (outfile, "}, \"total_seconds\": %.6f, \"counters\": {",
+               total);
+      for (int counter = 0; counter < COUNTERS; ++counter) {
+         fprintf (outfile, "%s\"%s\": %llu", counter ? ", " : "",
+                  counter_names[counter],
+                  static_cast<unsigned long long> (counts[counter]));
+      }
+      fprintf (outfile, "}, \"symbol_memory\": {");
+      for (int kind = 0; kind < SYMBOL_KINDS; ++kind) {
+         fprintf (outfile, "%s\"%s\": {\"count\": %llu, \"bytes\": %llu}",
+                  kind ? ", " : "", symbol_kind_names[kind],
+                  static_cast<unsigned long long> (symbol_counts[kind]),
+                  static_cast<unsigned long long> (symbol_bytes[kind]));
+      }
+      fprintf (outfile, "}}}\n");
+      return;
+   }
+   fprintf (outfile, "%s:\n", filename);
+   fprintf (outfile, "   %-12s %10s %6s %12s\n", "phase", "ms", "%",
+            "allocations");
+   for (int phase = 0; phase < PHASES; ++phase) {
+      fprintf (outfile, "   %-12s %10.3f %6.1f %12llu\n",
+               phase_names[phase], seconds[phase] * 1e3,
+               total > 0 ? 100 * seconds[phase] / total : 0.0,
+               static_cast<unsigned long long> (phase_allocations[phase]));
+   }
+   fprintf (outfile, "   %-12s %10.3f\n", "total", total * 1e3);
+   for (int counter = 0; counter < COUNTERS; ++counter) {
+      fprintf (outfile, "   %-12s %10llu\n", counter_names[counter],
+               static_cast<unsigned long long> (counts[counter]));
+   }
+   fprintf (outfile, "   %-12s %10s %12s\n", "symbols", "count", "bytes");
+   for (int kind = 0; kind < SYMBOL_KINDS; ++kind) {
+      fprintf (outfile, "   %-12s %10llu %12llu\n", symbol_kind_names[kind],
+               static_cast<unsigned long long> (symbol_counts[kind]),
+               static_cast<unsigned long long> (symbol_bytes[kind]));
+   }
+}
+
+//
+// Replacement global allocation functions, so that --stats can count
+// every heap allocation.  Array and nothrow forms go through these.
+//
+
+void* operator new (size_t size) {
+   stats::count_allocation();
+   void* result = malloc (size == 0 ? 1 : size);
+   if (result == nullptr) throw bad_alloc();
+   return result;
+}
+
+void operator delete (void* pointer) noexcept {
+   free (pointer);
+}
+
+void operator delete (void* pointer, size_t) noexcept {
+   free (pointer);
+}
+
@@ -0,0 +1,82 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+using namespace std;
+
+//
+// DESCRIPTION
+//    Opt-in phase timers and counters for oc --stats.  Everything is
+//    guarded by stats::enabled, so with --stats off a phase costs two
+//    untaken branches and a counter costs one.  Heap allocations are
+//    counted by the replacement operator new in stats.cpp and charged
+//    to the phase that is running.
+//
+
+struct stats {
+   enum phase { PREPROCESS, CACHE, PARSE, SEMANTIC, AST, OIL, STR,
+                RELEASE, PHASES };
+   enum counter { TOKENS, NODES, SYMBOLS, STRINGS, FOLDS, VREGS,
+                  OIL_LINES, COUNTERS };
+   enum format { TEXT, JSON };
+   enum symbol_kind { FUNCTION_SYMBOLS, PARAM_SYMBOLS, FIELD_SYMBOLS,
+                      VARIABLE_SYMBOLS, STRUCT_SYMBOLS, OTHER_SYMBOLS,
+                      LINKS, SYMBOL_KINDS };
+
+   static bool enabled;
+   static format output;
+
+   static void add (counter which, uint64_t amount = 1) {
+      if (enabled) counts[which] += amount;
+   }
+   static void set (counter which, uint64_t value) {
+      if (enabled) counts[which] = value;
+   }
+   static void add_symbol_memory (symbol_kind which, uint64_t bytes,
+                                  uint64_t count = 1) {
+      if (enabled) {
+         symbol_counts[which] += count;
+         symbol_bytes[which] += bytes;
+      }
+   }
+   // Called as the symbol arena is released.  FIELD_SYMBOLS covers
+   // the struct layouts, LINKS scope bindings and spilled parameter
+   // lists.
+   static void count_allocation() {
+      if (enabled) allocations.fetch_add (1, memory_order_relaxed);
+   }
+   // Called from operator new.
+
+   static void print (FILE* outfile, const char* filename);
+   // Prints everything gathered so far in the chosen format.
+
+   struct timer {
+      // Times one phase from construction to destruction.
+      explicit timer (phase which_): which (which_) {
+         if (enabled) begin();
+      }
+      ~timer() { if (enabled) end(); }
+      timer (const timer&) = delete;
+      timer& operator= (const timer&) = delete;
+      private:
+         phase which;
+         chrono::steady_clock::time_point start;
+         uint64_t start_allocations = 0;
+         void begin();
+         void end();
+   };
+
+   private:
+      static uint64_t counts[COUNTERS];
+      static double seconds[PHASES];
+      static uint64_t phase_allocations[PHASES];
+      static atomic<uint64_t> allocations;
+      static uint64_t symbol_counts[SYMBOL_KINDS];
+      static uint64_t symbol_bytes[SYMBOL_KINDS];
+};
+
+#endif
+
@@ -1,25 +1,124 @@
 // $Id: string_set.cpp,v 1.1 2017/04/15 03:38:25 ttching Exp $
 
+#include <stddef.h>
+#include <string.h>
 #include <string>
 #include <unordered_set>
 using namespace std;
 
 #include "string_set.h"
 
-unordered_set<string> string_set::set;
+constexpr size_t string_set::shard_count;
+string_set::shard string_set::shards[shard_count];
 
-string_set::string_set() {
-   set.max_load_factor (0.5);
+static size_t hash_chars (const char* chars, size_t len) {
+#ifdef __GLIBCXX__
+   // Same function hash<string> uses, without building a string.
+   return _Hash_bytes (chars, len, static_cast<size_t> (0xc70f6907UL));
+#else
+   return hash<string>() (string (chars, len));
+#endif
 }
 
-const string* string_set::intern (const char* string) {
-   auto handle = set.insert (string);
-   return &*handle.first;
+static string_set::table* new_table (size_t capacity) {
+   auto result = new string_set::table;
+   result->mask = capacity - 1;
+   result->slots = new atomic<string_set::entry*>[capacity];
+   for (size_t slot = 0; slot < capacity; ++slot) {
+      result->slots[slot].store (nullptr, memory_order_relaxed);
+   }
+   return result;
+}
+
+static string_set::entry* find (string_set::table* index, size_t hash,
+                                const char* chars, size_t len) {
+   if (index == nullptr) return nullptr;
+   for (size_t slot = hash;; ++slot) {
+      string_set::entry* found
+            = index->slots[slot & index->mask].load (memory_order_acquire);
+      if (found == nullptr) return nullptr;
+      if (found->hash == hash and found->length == len
+          and memcmp (found->data(), chars, len) == 0) return found;
+   }
+}
+
+static void place (string_set::table* index, string_set::entry* item) {
+   size_t slot = item->hash;
+   while (index->slots[slot & index->mask].load (memory_order_relaxed)
+          != nullptr) ++slot;
+   index->slots[slot & index->mask].store (item, memory_order_release);
+}
+
+const interned* string_set::intern (const char* chars) {
+   return intern (chars, strlen (chars));
 }
 
-void string_set::dump (FILE* out) {
-   static unordered_set<string>::hasher hash_fn
-               = string_set::set.hash_function();
+const interned* string_set::intern (const char* chars, size_t len) {
+   size_t hash = hash_chars (chars, len);
+   // Low bits pick the slot inside a shard, so use high bits here.
+   shard& owner = shards[(hash >> 32) % shard_count];
+   entry* found = find (owner.index.load (memory_order_acquire),
+                        hash, chars, len);
+   if (found != nullptr) return found;
+
+   lock_guard<mutex> guard (owner.lock);
+   table* index = owner.index.load (memory_order_relaxed);
+   found = find (index, hash, chars, len);
+   if (found != nullptr) return found;
+   if (index == nullptr or (owner.count + 1) * 2 > index->mask + 1) {
+      // Readers may still be probing the old table, so it is kept.
+      table* bigger = new_table (index == nullptr ? 64
+                                                  : (index->mask + 1) * 2);
+      if (index != nullptr) {
+         for (size_t slot = 0; slot <= index->mask; ++slot) {
+            entry* item = index->slots[slot].load (memory_order_relaxed);
+            if (item != nullptr) place (bigger, item);
+         }
+         owner.retired.push_back (index);
+      }
+      index = bigger;
+      owner.index.store (index, memory_order_release);
+   }
+   // The characters go right after the entry.
+   void* storage = owner.slab.allocate (sizeof (entry) + len + 1,
+                                        alignof (entry));
+   entry* item = new (storage) entry {hash, nullptr, nullptr, len};
+   char* text = reinterpret_cast<char*> (item + 1);
+   memcpy (text, chars, len);
+   text[len] = '\0';
+   place (index, item);
+   ++owner.count;
+   return item;
+}
+
+size_t string_set::size() {
+   size_t count = 0;
+   for (auto& owner: shards) {
+      lock_guard<mutex> guard (owner.lock);
+      count += owner.count;
+   }
+   return count;
+}
+
+// Statistics are reported as if every string were in one chained
+// table, as they were before the set was sharded.
+void string_set::dump (outbuf& out) {
+   struct deref_equal {
+      bool operator() (const interned* a, const interned* b) const {
+         return a->size() == b->size()
+            and memcmp (a->data(), b->data(), a->size()) == 0;
+      }
+   };
+   unordered_set<const interned*,interned_hash,deref_equal> set;
+   for (auto& owner: shards) {
+      lock_guard<mutex> guard (owner.lock);
+      table* index = owner.index.load (memory_order_relaxed);
+      if (index == nullptr) continue;
+      for (size_t slot = 0; slot <= index->mask; ++slot) {
+         entry* item = index->slots[slot].load (memory_order_relaxed);
+         if (item != nullptr) set.insert (item);
+      }
+   }
    size_t max_bucket_size = 0;
    for (size_t bucket = 0; bucket < set.bucket_count(); ++bucket) {
       bool need_index = true;
@@ -27,16 +126,16 @@ void string_set::dump (FILE* out) {
       if (max_bucket_size < curr_size) max_bucket_size = curr_size;
       for (auto itor = set.cbegin (bucket);
            itor != set.cend (bucket); ++itor) {
-         if (need_index) fprintf (out, "string_set[%4zu]: ", bucket);
-                    else fprintf (out, "          %4s   ", "");
+         if (need_index) out.printf ("string_set[%4zu]: ", bucket);
+                    else out.printf ("          %4s   ", "");
          need_index = false;
-         const string* str = &*itor;
-         fprintf (out, "%22zu %p->\"%s\"\n", hash_fn(*str),
+         const interned* str = *itor;
+         out.printf ("%22zu %p->\"%s\"\n", hash_of (str),
                   str, str->c_str());
       }
    }
-   fprintf (out, "load_factor = %.3f\n", set.load_factor());
-   fprintf (out, "bucket_count = %zu\n", set.bucket_count());
-   fprintf (out, "max_bucket_size = %zu\n", max_bucket_size);
+   out.printf ("load_factor = %.3f\n", set.load_factor());
+   out.printf ("bucket_count = %zu\n", set.bucket_count());
+   out.printf ("max_bucket_size = %zu\n", max_bucket_size);
 }
 
@@ -3,17 +3,82 @@
 #ifndef __STRING_SET__
 #define __STRING_SET__
 
+#include <atomic>
+#include <mutex>
 #include <string>
-#include <unordered_set>
+#include <vector>
 using namespace std;
 
-#include <stdio.h>
+#include "arena.h"
+#include "outbuf.h"
+
+struct binding;
+
+//
+// An interned string, and the handle to it.  The characters follow
+// the record in the same slab, with a NUL after them, so interning a
+// string of any length allocates nothing of its own.  The record
+// also heads the lists of declarations of that name in the value and
+// type namespaces, so the symbol tables resolve a name with one load
+// instead of one hash probe per open scope.
+//
+
+struct interned {
+   size_t hash;
+   binding* value;              // innermost variable or function
+   binding* type;               // struct name
+   size_t length;
+   const char* data() const {
+      return reinterpret_cast<const char*> (this + 1);
+   }
+   const char* c_str() const { return data(); }
+   size_t size() const { return length; }
+   char operator[] (size_t index) const { return data()[index]; }
+   string str() const { return string (data(), length); }
+};
+
+//
+// Interned strings are spread over shards by hash.  Each shard keeps
+// its entries in arena slabs and indexes them with an open-addressing
+// table of atomic slots.  Finding a string that is already interned
+// never takes a lock; only inserting a new string locks its shard.
+// Handles are stable for the life of the process, and the hash of
+// every interned string is stored in it, so hash_of() is O(1).
+//
 
 struct string_set {
-   string_set();
-   static unordered_set<string> set;
-   static const string* intern (const char*);
-   static void dump (FILE*);
+   using entry = interned;
+   struct table {
+      size_t mask;
+      atomic<entry*>* slots;
+   };
+   struct shard {
+      mutex lock;
+      atomic<table*> index {nullptr};
+      vector<table*> retired;
+      arena slab;
+      size_t count = 0;
+   };
+   static constexpr size_t shard_count = 64;
+   static shard shards[shard_count];
+
+   static const interned* intern (const char*);
+   static const interned* intern (const char*, size_t len);
+   static size_t hash_of (const interned* handle) { return handle->hash; }
+   // Hash of an interned string, equal to hash<string> of its text.
+   static entry& entry_of (const interned* handle) {
+      return *const_cast<entry*> (handle);
+   }
+   // The entry of a handle, whose bindings can change.
+   static size_t size();
+   static void dump (outbuf&);
+};
+
+// Hasher for containers keyed on interned string handles.
+struct interned_hash {
+   size_t operator() (const interned* handle) const {
+      return string_set::hash_of (handle);
+   }
 };
 
 #endif